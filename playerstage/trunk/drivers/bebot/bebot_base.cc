@@ -139,6 +139,23 @@ int BeBotBase::MainSetup()
     return -1;
   }
 
+  // only read complete frames and don't wait for the motors on write
+  __u32 flags = SENSEACT_FLAG_FRAME | SENSEACT_FLAG_ASYNC;
+  if (ioctl(this->device, SENSEACT_IOCSFLAGS, &flags) == -1)
+    PLAYER_WARN1("Couldn't enable frame mode of senseact device %s", this->device_name);
+
+  // increments are not used
+  struct senseact_filter filter;
+  filter.types = SENSEACT_TYPE_BIT(SENSEACT_TYPE_SYNC) |
+                 SENSEACT_TYPE_BIT(SENSEACT_TYPE_SPEED) |
+                 SENSEACT_TYPE_BIT(SENSEACT_TYPE_POSITION) |
+                 SENSEACT_TYPE_BIT(SENSEACT_TYPE_ANGLE);
+  filter.index_min = 0;
+  filter.index_max = 255;
+  filter.flags = SENSEACT_FILTER_NO_ACK;
+  if (ioctl(this->device, SENSEACT_IOCSFILTER, &filter) == -1)
+    PLAYER_WARN1("Couldn't set filter of senseact device %s", this->device_name);
+
   return 0;
 }
 
@@ -250,6 +267,8 @@ void BeBotBase::Main()
     int n = read(this->device, (void*)actions,
 		 10 * sizeof(struct senseact_action));
 
+    n = (n > 0) ? n / sizeof(struct senseact_action) : 0;
+
     for (int i = 0; i < n; i++)
     {
       switch (actions[i].type)
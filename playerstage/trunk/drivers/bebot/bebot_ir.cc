@@ -230,6 +230,30 @@ int BeBotIR::MainSetup()
     }
     else
     {
+      // only read complete frames
+      __u32 flags = SENSEACT_FLAG_FRAME;
+      if (ioctl(this->devices[i], SENSEACT_IOCSFLAGS, &flags) == -1)
+        PLAYER_WARN1("Couldn't enable frame mode of senseact device %s", this->devices_name[i]);
+
+      // skip the enable acknowledgements
+      struct senseact_filter filter;
+      filter.types = SENSEACT_TYPE_BIT(SENSEACT_TYPE_SYNC) |
+                     SENSEACT_TYPE_BIT(SENSEACT_TYPE_BRIGHTNESS);
+      filter.index_min = 0;
+      filter.index_max = this->sensors_count[i] - 1;
+      filter.flags = SENSEACT_FILTER_NO_ACK;
+      if (ioctl(this->devices[i], SENSEACT_IOCSFILTER, &filter) == -1)
+        PLAYER_WARN1("Couldn't set filter of senseact device %s", this->devices_name[i]);
+
+      // compare the configured sensors with the ones of the device
+      struct senseact_capability cap;
+      memset(&cap, 0, sizeof(cap));
+      cap.type = SENSEACT_TYPE_BRIGHTNESS;
+      if (ioctl(this->devices[i], SENSEACT_IOCGCAPABILITY, &cap) == 0 &&
+          cap.count < (__u32)this->sensors_count[i])
+        PLAYER_WARN3("Senseact device %s only has %u of %d sensors",
+                     this->devices_name[i], cap.count, this->sensors_count[i]);
+
       this->sensors_sum += this->sensors_count[i];
       if (this->devices[i] > this->devices_nfds)
         this->devices_nfds = this->devices[i];
@@ -328,6 +352,8 @@ void BeBotIR::Main()
 	    int n = read(this->devices[i], (void*)actions,
 		    (this->sensors_count[i] + 1) * sizeof(struct senseact_action));
 
+	    n = (n > 0) ? n / sizeof(struct senseact_action) : 0;
+
 	    for (int j = 0; j < n; j++)
 	    {
 	      if (actions[j].type == SENSEACT_TYPE_BRIGHTNESS)
@@ -117,6 +117,11 @@ static int bebot_base_poll(struct senseact_poll_device *senseact_poll)
 	senseact_pass_actions(senseact, SENSEACT_TYPE_SPEED, SENSEACT_PREFIX_MILLI, 2, GETSPEED_COUNT, values);
 	senseact_sync(senseact, SENSEACT_SYNC_SENSOR);
 
+	/* the robot is active while a motor turns or is told to */
+	for (i = 0; i < GETSPEED_COUNT; i++)
+		if (speeds[i] || base->speed[i])
+			return 1;
+
 	return 0;
 }
 
@@ -192,6 +197,9 @@ static int bebot_base_probe(struct i2c_client *client,
 	/* set senseact poll device handler */
 	senseact_poll->poll = bebot_base_poll;
 	senseact_poll->poll_interval = 250;
+	senseact_poll->min_interval = 10;
+	senseact_poll->max_interval = 500;
+	senseact_poll->precise = 1;
 
 	/* set senseact device handler */	
 	senseact = senseact_poll->senseact;
@@ -208,6 +216,10 @@ static int bebot_base_probe(struct i2c_client *client,
 	senseact_set_capabilities(senseact, SENSEACT_TYPE_POSITION, 2);
 	senseact_set_capability(senseact, SENSEACT_TYPE_ANGLE);
 
+	senseact_set_unit(senseact, SENSEACT_TYPE_SPEED, SENSEACT_PREFIX_MILLI, SENSEACT_UNIT_METER_PER_SECOND);
+	senseact_set_unit(senseact, SENSEACT_TYPE_POSITION, SENSEACT_PREFIX_MILLI, SENSEACT_UNIT_METER);
+	senseact_set_unit(senseact, SENSEACT_TYPE_ANGLE, SENSEACT_PREFIX_MILLI, SENSEACT_UNIT_RADIAN);
+
 	rc = senseact_register_poll_device(senseact_poll);
 	if (rc) {
 		dev_err(&client->dev, "could not register senseact poll device\n");
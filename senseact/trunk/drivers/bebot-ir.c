@@ -25,12 +25,16 @@
 #define ENABLE_REG		0x2F	/* byte, RW */
 #define ENABLE_REG2		0x3E	/* word, RW */
 
+/* change of a sensor value which makes the sensors active */
+#define SENSOR_THRESHOLD	20
+
 struct bebot_ir_device {
 	struct senseact_poll_device *senseact_poll;
 	struct i2c_client *client;
 	char addr[32];
 	u16 count;
 	u16 enable;
+	int last[SENSOR_COUNT];
 };
 
 static int bebot_ir_write_enable(struct bebot_ir_device *ir)
@@ -55,7 +59,7 @@ static int bebot_ir_poll(struct senseact_poll_device *senseact_poll)
 	u8 buffer[SENSOR_SIZE];
 	u16 temp;
 	int values[SENSOR_COUNT];
-	int n, i;
+	int n, i, active = 0;
 
 	n = i2c_smbus_read_i2c_block_data(client, SENSOR_REG,
 					  SENSOR_TYPE * ir->count, buffer);
@@ -65,12 +69,17 @@ static int bebot_ir_poll(struct senseact_poll_device *senseact_poll)
 	for (i = 0; i < (n / SENSOR_TYPE); i++) {
 		temp = (buffer[(i * 2) + 1] << 8) | buffer[i * 2];
 		values[i] = le16_to_cpu(temp);
+
+		if (abs(values[i] - ir->last[i]) > SENSOR_THRESHOLD) {
+			ir->last[i] = values[i];
+			active = 1;
+		}
 	}
 
 	senseact_pass_actions(senseact, SENSEACT_TYPE_BRIGHTNESS, SENSEACT_PREFIX_NONE, 0, n / SENSOR_TYPE, values);
 	senseact_sync(senseact, SENSEACT_SYNC_SENSOR);
 
-	return 0;
+	return active;
 }
 
 static int bebot_ir_pass(struct senseact_device *senseact, unsigned int type, unsigned int index, unsigned int count, int *values)
@@ -124,7 +133,7 @@ static int bebot_ir_probe(struct i2c_client *client,
 				     | I2C_FUNC_SMBUS_I2C_BLOCK))
 		return -ENODEV;
 
-	ir = kmalloc(sizeof(struct bebot_ir_device), GFP_KERNEL);
+	ir = kzalloc(sizeof(struct bebot_ir_device), GFP_KERNEL);
 	if (!ir) {
 		dev_err(&client->dev, "not enough memory for bebot_ir device\n");
 		rc = -ENOMEM;
@@ -153,6 +162,9 @@ static int bebot_ir_probe(struct i2c_client *client,
 	/* set senseact poll device handler */
 	senseact_poll->poll = bebot_ir_poll;
 	senseact_poll->poll_interval = 250;
+	senseact_poll->min_interval = 20;
+	senseact_poll->max_interval = 500;
+	senseact_poll->precise = 1;
 
 	/* set senseact device handler */	
 	senseact = senseact_poll->senseact;
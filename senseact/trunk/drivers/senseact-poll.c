@@ -14,45 +14,127 @@
 #include <linux/slab.h>
 #include <linux/jiffies.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
 #include <linux/senseact-poll.h>
 
-static DEFINE_MUTEX(senseact_poll_mutex);
-static int senseact_poll_users;
-static struct workqueue_struct *senseact_poll_wq;
+#include "senseact-trace.h"
 
-static int senseact_poll_start_workqueue(void)
+static bool highpri;
+module_param(highpri, bool, 0444);
+MODULE_PARM_DESC(highpri, "Poll devices from high priority workers");
+
+/*
+ * Sampling group of poll devices. The open members are polled back to
+ * back in every tick of the group and share the timestamp and sequence
+ * number of their frames. The group runs at a fixed rate given by the
+ * shortest interval of its open members.
+ */
+struct senseact_poll_group {
+	unsigned int id;
+	unsigned int members;
+	unsigned int users;
+	struct list_head node;
+	struct list_head member_list;
+	struct mutex lock;		/* protects @users */
+	struct mutex poll_mutex;	/* protects @member_list, held by a tick */
+	struct workqueue_struct *wq;
+	struct hrtimer timer;
+	struct work_struct work;
+	unsigned int interval;
+	ktime_t time;
+	u32 sequence;
+};
+
+static LIST_HEAD(senseact_poll_groups);
+static DEFINE_MUTEX(senseact_poll_groups_mutex);
+
+static void senseact_poll_account(unsigned long *hist, ktime_t from, ktime_t to)
 {
-	int rc;
+	s64 us = ktime_us_delta(to, from);
+	unsigned int bucket = us > 0 ? fls(min_t(s64, us, INT_MAX)) : 0;
 
-	rc = mutex_lock_interruptible(&senseact_poll_mutex);
-	if (rc)
-		return rc;
+	hist[min_t(unsigned int, bucket, SENSEACT_POLL_HIST - 1)]++;
+}
 
-	if (!senseact_poll_users) {
-		senseact_poll_wq = create_singlethread_workqueue("senseactpolld");
-		if (!senseact_poll_wq) {
-			printk(KERN_ERR "senseact-poll: failed to create "
-				"senseactpolld workqueue\n");
-			rc = -ENOMEM;
-			goto out;
-		}
-	}
+/*
+ * The interval set through sysfs has precedence. In adaptive mode the
+ * interval requested by the open files bounds the adaptive one, else it
+ * replaces the default one.
+ */
+static unsigned int senseact_poll_interval(struct senseact_poll_device *senseact_poll)
+{
+	unsigned int interval;
 
-	senseact_poll_users++;
+	if (senseact_poll->override)
+		return senseact_poll->override;
 
- out:
-	mutex_unlock(&senseact_poll_mutex);
-	return rc;
+	if (!senseact_poll->max_interval)
+		return senseact_poll->requested ? : senseact_poll->default_interval;
+
+	interval = senseact_poll->adaptive;
+	if (senseact_poll->requested && senseact_poll->requested < interval)
+		interval = senseact_poll->requested;
+
+	return interval;
+}
+
+/*
+ * Adaptive mode: halve the interval while the device is active, let it
+ * grow by a quarter while it is idle. Failed polls leave it alone.
+ */
+static void senseact_poll_adapt(struct senseact_poll_device *senseact_poll,
+				int rc)
+{
+	unsigned int adaptive = senseact_poll->adaptive;
+
+	if (!senseact_poll->max_interval || rc < 0)
+		return;
+
+	if (rc > 0)
+		adaptive = max(adaptive / 2, senseact_poll->min_interval);
+	else
+		adaptive = min(adaptive + adaptive / 4 + 1,
+			       senseact_poll->max_interval);
+
+	senseact_poll->adaptive = adaptive;
+	senseact_poll->poll_interval = senseact_poll_interval(senseact_poll);
 }
 
-static void senseact_poll_stop_workqueue(void)
+/*
+ * The statistics are only updated by the work of the device, which never
+ * runs concurrently with itself.
+ */
+static void senseact_poll_do(struct senseact_poll_device *senseact_poll,
+			     struct senseact_poll_group *group)
 {
-	mutex_lock(&senseact_poll_mutex);
+	ktime_t start;
+	int rc;
+
+	start = ktime_get();
+	senseact_poll_account(senseact_poll->period, senseact_poll->last, start);
+	senseact_poll->last = start;
 
-	if (!--senseact_poll_users)
-		destroy_workqueue(senseact_poll_wq);
+	trace_senseact_poll_start(senseact_poll->senseact,
+				  senseact_poll->poll_interval);
+
+	if (group)
+		senseact_begin_frame_at(senseact_poll->senseact,
+					group->time, group->sequence);
+	else
+		senseact_begin_frame(senseact_poll->senseact);
+
+	rc = senseact_poll->poll(senseact_poll);
+	if (rc < 0) {
+		senseact_poll->errors++;
+		senseact_abort_frame(senseact_poll->senseact);
+	}
 
-	mutex_unlock(&senseact_poll_mutex);
+	trace_senseact_poll_end(senseact_poll->senseact, rc);
+
+	senseact_poll->polls++;
+	senseact_poll_account(senseact_poll->duration, start, ktime_get());
+
+	senseact_poll_adapt(senseact_poll, rc);
 }
 
 static void senseact_poll_work(struct work_struct *work)
@@ -61,38 +143,441 @@ static void senseact_poll_work(struct work_struct *work)
 		container_of(work, struct senseact_poll_device, work.work);
 	unsigned long delay;
 
-	senseact_poll->poll(senseact_poll);
+	senseact_poll_do(senseact_poll, NULL);
 
 	delay = msecs_to_jiffies(senseact_poll->poll_interval);
 	if (delay >= HZ)
 		delay = round_jiffies_relative(delay);
 
-	queue_delayed_work(senseact_poll_wq, &senseact_poll->work, delay);
+	queue_delayed_work(senseact_poll->wq, &senseact_poll->work, delay);
+}
+
+static void senseact_poll_tick(struct work_struct *work)
+{
+	struct senseact_poll_device *senseact_poll =
+		container_of(work, struct senseact_poll_device, tick);
+
+	senseact_poll_do(senseact_poll, NULL);
+}
+
+/*
+ * Precise mode: the timer is advanced by whole intervals from its last
+ * expiry, so the polls keep a fixed rate regardless of their duration.
+ * Intervals which passed while a poll was still running are skipped.
+ */
+static enum hrtimer_restart senseact_poll_timer(struct hrtimer *timer)
+{
+	struct senseact_poll_device *senseact_poll =
+		container_of(timer, struct senseact_poll_device, timer);
+	u64 overruns;
+
+	overruns = hrtimer_forward_now(timer,
+			ms_to_ktime(senseact_poll->poll_interval));
+	if (overruns > 1)
+		senseact_poll->missed += overruns - 1;
+
+	if (!queue_work(senseact_poll->wq, &senseact_poll->tick))
+		senseact_poll->missed++;
+
+	return HRTIMER_RESTART;
+}
+
+static void senseact_poll_group_work(struct work_struct *work)
+{
+	struct senseact_poll_group *group =
+		container_of(work, struct senseact_poll_group, work);
+	struct senseact_poll_device *senseact_poll;
+	unsigned int interval = 0;
+
+	mutex_lock(&group->poll_mutex);
+
+	group->time = ktime_get();
+	group->sequence++;
+
+	list_for_each_entry(senseact_poll, &group->member_list, group_node) {
+		if (!ACCESS_ONCE(senseact_poll->group_active))
+			continue;
+
+		senseact_poll_do(senseact_poll, group);
+
+		if (!interval || senseact_poll->poll_interval < interval)
+			interval = senseact_poll->poll_interval;
+	}
+
+	if (interval)
+		group->interval = interval;
+
+	mutex_unlock(&group->poll_mutex);
+}
+
+static enum hrtimer_restart senseact_poll_group_timer(struct hrtimer *timer)
+{
+	struct senseact_poll_group *group =
+		container_of(timer, struct senseact_poll_group, timer);
+
+	hrtimer_forward_now(timer, ms_to_ktime(group->interval));
+	queue_work(group->wq, &group->work);
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Join the group @id, which is created by its first member. Called with
+ * the mutex of the senseact device held while the device is not polled.
+ */
+static int senseact_poll_join(struct senseact_poll_device *senseact_poll,
+			      unsigned int id)
+{
+	struct senseact_poll_group *group;
+	int rc = 0;
+
+	mutex_lock(&senseact_poll_groups_mutex);
+
+	list_for_each_entry(group, &senseact_poll_groups, node)
+		if (group->id == id)
+			goto join;
+
+	group = kzalloc(sizeof(struct senseact_poll_group), GFP_KERNEL);
+	if (!group) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	group->wq = alloc_workqueue("senseactpolld-group%u",
+				    WQ_UNBOUND | (highpri ? WQ_HIGHPRI : 0),
+				    1, id);
+	if (!group->wq) {
+		kfree(group);
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	group->id = id;
+	INIT_LIST_HEAD(&group->member_list);
+	mutex_init(&group->lock);
+	mutex_init(&group->poll_mutex);
+	INIT_WORK(&group->work, senseact_poll_group_work);
+	hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	group->timer.function = senseact_poll_group_timer;
+	list_add_tail(&group->node, &senseact_poll_groups);
+
+ join:
+	group->members++;
+
+	mutex_lock(&group->poll_mutex);
+	/* keep the sequence numbers of the new member increasing */
+	if ((s32)(senseact_poll->senseact->sequence - group->sequence) > 0)
+		group->sequence = senseact_poll->senseact->sequence;
+	list_add_tail(&senseact_poll->group_node, &group->member_list);
+	mutex_unlock(&group->poll_mutex);
+
+	senseact_poll->group = group;
+	senseact_poll->group_id = id;
+
+ out:
+	mutex_unlock(&senseact_poll_groups_mutex);
+	return rc;
+}
+
+/*
+ * Leave the group of the device, the last member frees it. Called with
+ * the mutex of the senseact device held while the device is not polled.
+ */
+static void senseact_poll_leave(struct senseact_poll_device *senseact_poll)
+{
+	struct senseact_poll_group *group = senseact_poll->group;
+
+	mutex_lock(&senseact_poll_groups_mutex);
+
+	mutex_lock(&group->poll_mutex);
+	list_del(&senseact_poll->group_node);
+	mutex_unlock(&group->poll_mutex);
+
+	if (!--group->members) {
+		list_del(&group->node);
+		destroy_workqueue(group->wq);
+		kfree(group);
+	}
+
+	senseact_poll->group = NULL;
+	senseact_poll->group_id = 0;
+
+	mutex_unlock(&senseact_poll_groups_mutex);
+}
+
+static void senseact_poll_group_start(struct senseact_poll_device *senseact_poll)
+{
+	struct senseact_poll_group *group = senseact_poll->group;
+
+	mutex_lock(&group->lock);
+
+	senseact_poll->group_active = 1;
+
+	if (!group->users++) {
+		group->interval = senseact_poll->poll_interval;
+		hrtimer_start(&group->timer, ms_to_ktime(group->interval),
+			      HRTIMER_MODE_REL);
+	} else if (senseact_poll->poll_interval < group->interval) {
+		group->interval = senseact_poll->poll_interval;
+	}
+
+	mutex_unlock(&group->lock);
+}
+
+static void senseact_poll_group_stop(struct senseact_poll_device *senseact_poll)
+{
+	struct senseact_poll_group *group = senseact_poll->group;
+
+	mutex_lock(&group->lock);
+
+	if (!senseact_poll->group_active)
+		goto out;
+
+	senseact_poll->group_active = 0;
+
+	if (!--group->users) {
+		hrtimer_cancel(&group->timer);
+		cancel_work_sync(&group->work);
+	}
+
+	/* wait for a tick which may still poll the device */
+	mutex_lock(&group->poll_mutex);
+	mutex_unlock(&group->poll_mutex);
+
+ out:
+	mutex_unlock(&group->lock);
+}
+
+static void senseact_poll_start(struct senseact_poll_device *senseact_poll)
+{
+	senseact_poll->last = ktime_get();
+
+	if (senseact_poll->group)
+		senseact_poll_group_start(senseact_poll);
+	else if (senseact_poll->precise)
+		hrtimer_start(&senseact_poll->timer,
+			      ms_to_ktime(senseact_poll->poll_interval),
+			      HRTIMER_MODE_REL);
+	else
+		queue_delayed_work(senseact_poll->wq, &senseact_poll->work,
+				   msecs_to_jiffies(senseact_poll->poll_interval));
+}
+
+static void senseact_poll_stop(struct senseact_poll_device *senseact_poll)
+{
+	if (senseact_poll->group) {
+		senseact_poll_group_stop(senseact_poll);
+	} else if (senseact_poll->precise) {
+		hrtimer_cancel(&senseact_poll->timer);
+		cancel_work_sync(&senseact_poll->tick);
+	} else {
+		cancel_delayed_work_sync(&senseact_poll->work);
+	}
 }
 
 static int senseact_poll_open(struct senseact_device *senseact)
 {
+	senseact_poll_start(senseact->private);
+	return 0;
+}
+
+static void senseact_poll_close(struct senseact_device *senseact)
+{
+	senseact_poll_stop(senseact->private);
+}
+
+/*
+ * Switch to a new interval after the one set through sysfs or the ones
+ * requested by the open files changed. A running poll cycle is
+ * restarted with the new interval. Called with the mutex of the senseact
+ * device held.
+ */
+static void senseact_poll_apply_interval(struct senseact_poll_device *senseact_poll)
+{
+	unsigned int interval;
+
+	interval = senseact_poll_interval(senseact_poll);
+	if (interval == senseact_poll->poll_interval)
+		return;
+
+	senseact_poll->poll_interval = interval;
+
+	/* groups pick up the interval with their next tick */
+	if (!senseact_poll->senseact->users || senseact_poll->group)
+		return;
+
+	if (senseact_poll->precise)
+		hrtimer_start(&senseact_poll->timer, ms_to_ktime(interval),
+			      HRTIMER_MODE_REL);
+	else
+		mod_delayed_work(senseact_poll->wq, &senseact_poll->work,
+				 msecs_to_jiffies(interval));
+}
+
+static void senseact_poll_set_interval(struct senseact_device *senseact,
+				       unsigned int interval)
+{
+	struct senseact_poll_device *senseact_poll = senseact->private;
+
+	senseact_poll->requested = interval;
+	senseact_poll_apply_interval(senseact_poll);
+}
+
+static ssize_t senseact_poll_show_hist(unsigned long *hist, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < SENSEACT_POLL_HIST - 1; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u %lu\n",
+				 1U << i, hist[i]);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len, "- %lu\n", hist[i]);
+	return len;
+}
+
+#define SENSEACT_POLL_ATTR_SHOW(name, show)				\
+static ssize_t senseact_poll_show_##name(struct device *dev,		\
+					 struct device_attribute *attr,	\
+					 char *buf)			\
+{									\
+	struct senseact_poll_device *senseact_poll =			\
+		to_senseact_device(dev)->private;			\
+									\
+	return show;							\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, senseact_poll_show_##name, NULL)
+
+SENSEACT_POLL_ATTR_SHOW(polls,
+	scnprintf(buf, PAGE_SIZE, "%lu\n", senseact_poll->polls));
+SENSEACT_POLL_ATTR_SHOW(errors,
+	scnprintf(buf, PAGE_SIZE, "%lu\n", senseact_poll->errors));
+SENSEACT_POLL_ATTR_SHOW(missed,
+	scnprintf(buf, PAGE_SIZE, "%lu\n", senseact_poll->missed));
+SENSEACT_POLL_ATTR_SHOW(period,
+	senseact_poll_show_hist(senseact_poll->period, buf));
+SENSEACT_POLL_ATTR_SHOW(duration,
+	senseact_poll_show_hist(senseact_poll->duration, buf));
+
+/*
+ * Reading the interval attribute reports the interval in use, writing a
+ * non-zero interval overrides the ones requested by the open files
+ * until 0 is written.
+ */
+static ssize_t senseact_poll_show_interval(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct senseact_poll_device *senseact_poll =
+		to_senseact_device(dev)->private;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", senseact_poll->poll_interval);
+}
+
+static ssize_t senseact_poll_store_interval(struct device *dev,
+					    struct device_attribute *attr,
+					    const char *buf, size_t count)
+{
+	struct senseact_device *senseact = to_senseact_device(dev);
 	struct senseact_poll_device *senseact_poll = senseact->private;
+	unsigned long interval;
 	int rc;
 
-	rc = senseact_poll_start_workqueue();
+	if (kstrtoul(buf, 0, &interval) || interval > UINT_MAX)
+		return -EINVAL;
+
+	rc = mutex_lock_interruptible(&senseact->mutex);
 	if (rc)
 		return rc;
 
-	queue_delayed_work(senseact_poll_wq, &senseact_poll->work,
-			   msecs_to_jiffies(senseact_poll->poll_interval));
+	senseact_poll->override = interval;
+	senseact_poll_apply_interval(senseact_poll);
 
-	return 0;
+	mutex_unlock(&senseact->mutex);
+	return count;
 }
 
-static void senseact_poll_close(struct senseact_device *senseact)
+static DEVICE_ATTR(interval, S_IRUGO | S_IWUSR,
+		   senseact_poll_show_interval, senseact_poll_store_interval);
+
+/*
+ * Devices with the same non-zero group attribute are sampled together,
+ * writing 0 removes the device from its group.
+ */
+static ssize_t senseact_poll_show_group(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
 {
+	struct senseact_poll_device *senseact_poll =
+		to_senseact_device(dev)->private;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", senseact_poll->group_id);
+}
+
+static ssize_t senseact_poll_store_group(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct senseact_device *senseact = to_senseact_device(dev);
 	struct senseact_poll_device *senseact_poll = senseact->private;
+	unsigned long id;
+	int rc;
+
+	if (kstrtoul(buf, 0, &id) || id > UINT_MAX)
+		return -EINVAL;
+
+	rc = mutex_lock_interruptible(&senseact->mutex);
+	if (rc)
+		return rc;
+
+	if (id == senseact_poll->group_id)
+		goto out;
+
+	if (senseact->users)
+		senseact_poll_stop(senseact_poll);
 
-	cancel_delayed_work_sync(&senseact_poll->work);
-	senseact_poll_stop_workqueue();
+	if (senseact_poll->group)
+		senseact_poll_leave(senseact_poll);
+
+	if (id)
+		rc = senseact_poll_join(senseact_poll, id);
+
+	if (senseact->users)
+		senseact_poll_start(senseact_poll);
+
+ out:
+	mutex_unlock(&senseact->mutex);
+	return rc ? rc : count;
 }
 
+static DEVICE_ATTR(group, S_IRUGO | S_IWUSR,
+		   senseact_poll_show_group, senseact_poll_store_group);
+
+static struct attribute *senseact_poll_attrs[] = {
+	&dev_attr_interval.attr,
+	&dev_attr_group.attr,
+	&dev_attr_polls.attr,
+	&dev_attr_errors.attr,
+	&dev_attr_missed.attr,
+	&dev_attr_period.attr,
+	&dev_attr_duration.attr,
+	NULL
+};
+
+/*
+ * The histograms list the upper bound of every bucket in microseconds
+ * together with its count.
+ */
+static struct attribute_group senseact_poll_attr_group = {
+	.name	= "poll",
+	.attrs	= senseact_poll_attrs,
+};
+
+static const struct attribute_group *senseact_poll_attr_groups[] = {
+	&senseact_poll_attr_group,
+	NULL
+};
+
 /**
  * senseact_allocate_poll_device - allocate memory for poll device
  *
@@ -146,15 +631,72 @@ EXPORT_SYMBOL(senseact_free_poll_device);
 int senseact_register_poll_device(struct senseact_poll_device *senseact_poll)
 {
 	struct senseact_device *senseact = senseact_poll->senseact;
+	unsigned int id;
+	int rc;
+
+	if (senseact_poll->max_interval &&
+	    (!senseact_poll->min_interval ||
+	     senseact_poll->min_interval > senseact_poll->max_interval))
+		return -EINVAL;
+
+	/*
+	 * Every device polls from a worker of its own, so a slow device
+	 * does not delay the others.
+	 */
+	senseact_poll->wq = alloc_workqueue("senseactpolld-%s",
+					    WQ_UNBOUND | (highpri ? WQ_HIGHPRI : 0),
+					    1, dev_name(&senseact->dev));
+	if (!senseact_poll->wq)
+		return -ENOMEM;
 
 	senseact->private = senseact_poll;
 	INIT_DELAYED_WORK(&senseact_poll->work, senseact_poll_work);
+	INIT_WORK(&senseact_poll->tick, senseact_poll_tick);
+	hrtimer_init(&senseact_poll->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	senseact_poll->timer.function = senseact_poll_timer;
 	if (!senseact_poll->poll_interval)
 		senseact_poll->poll_interval = 500;
+	senseact_poll->default_interval = senseact_poll->poll_interval;
+	if (senseact_poll->max_interval) {
+		senseact_poll->adaptive = clamp(senseact_poll->poll_interval,
+						senseact_poll->min_interval,
+						senseact_poll->max_interval);
+		senseact_poll->poll_interval = senseact_poll->adaptive;
+	}
+
+	/* the hrtimer of precise mode keeps up with millisecond intervals */
+	if (senseact_poll->min_interval)
+		senseact->min_interval = senseact_poll->min_interval;
+	else if (senseact_poll->precise)
+		senseact->min_interval = 1;
+
 	senseact->open = senseact_poll_open;
 	senseact->close = senseact_poll_close;
+	senseact->set_interval = senseact_poll_set_interval;
+	senseact->dev.groups = senseact_poll_attr_groups;
+
+	/* drivers may put the device into a sampling group right away */
+	id = senseact_poll->group_id;
+	senseact_poll->group_id = 0;
+	if (id) {
+		rc = senseact_poll_join(senseact_poll, id);
+		if (rc)
+			goto err_destroy_wq;
+	}
+
+	rc = senseact_register_device(senseact);
+	if (rc)
+		goto err_leave;
+
+	return 0;
 
-	return senseact_register_device(senseact);
+ err_leave:
+	if (senseact_poll->group)
+		senseact_poll_leave(senseact_poll);
+ err_destroy_wq:
+	destroy_workqueue(senseact_poll->wq);
+	senseact_poll->wq = NULL;
+	return rc;
 }
 EXPORT_SYMBOL(senseact_register_poll_device);
 
@@ -171,6 +713,14 @@ EXPORT_SYMBOL(senseact_register_poll_device);
 void senseact_unregister_poll_device(struct senseact_poll_device *senseact_poll)
 {
 	senseact_unregister_device(senseact_poll->senseact);
+
+	/* files still open must not poll on the destroyed workqueue */
+	senseact_poll_stop(senseact_poll);
+	if (senseact_poll->group)
+		senseact_poll_leave(senseact_poll);
+	destroy_workqueue(senseact_poll->wq);
+	senseact_poll->wq = NULL;
+
 	senseact_poll->senseact = NULL;
 }
 EXPORT_SYMBOL(senseact_unregister_poll_device);
@@ -0,0 +1,196 @@
+/*
+ * Tracepoints of the senseact data path
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM senseact
+
+#if !defined(_SENSEACT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SENSEACT_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/senseact.h>
+
+/*
+ * Actions reported by a device or passed to it.
+ */
+DECLARE_EVENT_CLASS(senseact_actions,
+
+	TP_PROTO(struct senseact_device *senseact, unsigned int type,
+		 unsigned int index, unsigned int count),
+
+	TP_ARGS(senseact, type, index, count),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, type)
+		__field(unsigned int, index)
+		__field(unsigned int, count)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->type = type;
+		__entry->index = index;
+		__entry->count = count;
+	),
+
+	TP_printk("minor=%u type=%u index=%u count=%u",
+		  __entry->minor, __entry->type, __entry->index, __entry->count)
+);
+
+DEFINE_EVENT(senseact_actions, senseact_pass_actions,
+	TP_PROTO(struct senseact_device *senseact, unsigned int type,
+		 unsigned int index, unsigned int count),
+	TP_ARGS(senseact, type, index, count)
+);
+
+DEFINE_EVENT(senseact_actions, senseact_write_pass,
+	TP_PROTO(struct senseact_device *senseact, unsigned int type,
+		 unsigned int index, unsigned int count),
+	TP_ARGS(senseact, type, index, count)
+);
+
+/*
+ * An action stored in the queue of an open file. @fill is the number of
+ * queued actions afterwards, @dropped the number of actions dropped.
+ */
+TRACE_EVENT(senseact_queue_insert,
+
+	TP_PROTO(struct senseact_device *senseact,
+		 const struct senseact_action_ext *action,
+		 unsigned int fill, unsigned int dropped),
+
+	TP_ARGS(senseact, action, fill, dropped),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, type)
+		__field(unsigned int, index)
+		__field(int, value)
+		__field(unsigned int, sequence)
+		__field(unsigned int, fill)
+		__field(unsigned int, dropped)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->type = action->type;
+		__entry->index = action->index;
+		__entry->value = action->value;
+		__entry->sequence = action->sequence;
+		__entry->fill = fill;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("minor=%u type=%u index=%u value=%d sequence=%u fill=%u dropped=%u",
+		  __entry->minor, __entry->type, __entry->index,
+		  __entry->value, __entry->sequence, __entry->fill,
+		  __entry->dropped)
+);
+
+/*
+ * @count actions read from the queue of an open file, which still holds
+ * @fill actions afterwards.
+ */
+TRACE_EVENT(senseact_read,
+
+	TP_PROTO(struct senseact_device *senseact, unsigned int count,
+		 unsigned int fill),
+
+	TP_ARGS(senseact, count, fill),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, count)
+		__field(unsigned int, fill)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->count = count;
+		__entry->fill = fill;
+	),
+
+	TP_printk("minor=%u count=%u fill=%u",
+		  __entry->minor, __entry->count, __entry->fill)
+);
+
+/*
+ * A write of @count actions carried out by the device.
+ */
+TRACE_EVENT(senseact_write,
+
+	TP_PROTO(struct senseact_device *senseact, unsigned int count,
+		 int retval),
+
+	TP_ARGS(senseact, count, retval),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, count)
+		__field(int, retval)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->count = count;
+		__entry->retval = retval;
+	),
+
+	TP_printk("minor=%u count=%u retval=%d",
+		  __entry->minor, __entry->count, __entry->retval)
+);
+
+/*
+ * Start and end of the poll() method of a polled device.
+ */
+TRACE_EVENT(senseact_poll_start,
+
+	TP_PROTO(struct senseact_device *senseact, unsigned int interval),
+
+	TP_ARGS(senseact, interval),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, interval)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->interval = interval;
+	),
+
+	TP_printk("minor=%u interval=%u", __entry->minor, __entry->interval)
+);
+
+TRACE_EVENT(senseact_poll_end,
+
+	TP_PROTO(struct senseact_device *senseact, int retval),
+
+	TP_ARGS(senseact, retval),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, retval)
+	),
+
+	TP_fast_assign(
+		__entry->minor = senseact->minor;
+		__entry->retval = retval;
+	),
+
+	TP_printk("minor=%u retval=%d", __entry->minor, __entry->retval)
+);
+
+#endif /* _SENSEACT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE senseact-trace
+#include <trace/define_trace.h>
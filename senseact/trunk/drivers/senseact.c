@@ -24,128 +24,1711 @@
 #include <linux/device.h>
 #include <linux/mutex.h>
 #include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/timekeeping.h>
+#include <linux/uio.h>
+#include <linux/cdev.h>
+#include <linux/idr.h>
+#include <linux/hardirq.h>
 
 #include <linux/senseact.h>
 
+#define CREATE_TRACE_POINTS
+#include "senseact-trace.h"
+
+EXPORT_TRACEPOINT_SYMBOL_GPL(senseact_poll_start);
+EXPORT_TRACEPOINT_SYMBOL_GPL(senseact_poll_end);
+
 #define SENSEACT_MAJOR			240
 
-#define SENSEACT_DEVICES		32
+#define SENSEACT_MINORS			1024
+
+#define SENSEACT_BUFFER_SIZE	64
+#define SENSEACT_BUFFER_MAX	4096
+
+#define SENSEACT_WRITE_MAX	256
+
+#define SENSEACT_INTERVAL_MIN	10
+
+#define SENSEACT_SHARED_SIZE	256
+
+#define SENSEACT_ACK_SIZE	(2 * (SENSEACT_WRITE_MAX + 1))
+
+/*
+ * Frame program of a queue together with its scratch memory.
+ */
+struct senseact_frame_prog {
+	unsigned int len;
+	s32 mem[SENSEACT_PROG_MEM];
+	struct senseact_insn insns[0];
+};
+
+/* marks actions deleted by a frame program until the frame is compacted */
+#define SENSEACT_TYPE_DELETED	0xff
+
+/*
+ * Every queue has a single producer, the actions of its device serialized
+ * by the action lock, and a single consumer, the reader serialized by the
+ * read mutex. The head is published with release semantics and the tail
+ * is committed with cmpxchg, as the producer may move it as well to drop
+ * actions. Changing the configuration of a queue takes the action lock to
+ * keep the producer out.
+ */
+struct senseact_queue {
+	struct senseact_ring *ring;
+	char *buffer;
+	unsigned int size;
+	unsigned int format;
+	unsigned int record_size;
+	unsigned int clock;
+	unsigned int head;
+	unsigned int pending;
+	unsigned int cursor;
+	unsigned int overruns;
+	unsigned int policy;
+	unsigned int flags;
+	unsigned int lowat;
+	struct senseact_filter filter;
+	struct senseact_frame_prog *prog;
+	unsigned int interval;
+	unsigned int frame_count;
+	unsigned int frame_len;
+	int dropping;
+	atomic_t mapped;
+	atomic64_t stats[SENSEACT_STAT_MAX];
+	struct mutex read_mutex;
+	struct fasync_struct *fasync;
+	struct senseact_device *senseact;
+	struct list_head node;
+};
+
+/*
+ * Broadcast ring of a device, read by all queues in shared mode through
+ * their own cursor. Every action is stored once with the times of all
+ * clocks. @next counts the actions stored, @head the published ones; a
+ * frame is published by its sync. The writer advances @next before it
+ * overwrites a slot, so readers can tell whether their copy is intact.
+ */
+struct senseact_shared_action {
+	struct senseact_action action;
+	u32 sequence;
+	ktime_t time[SENSEACT_CLK_MAX];
+};
+
+struct senseact_shared {
+	unsigned int head;
+	unsigned int next;
+	struct senseact_shared_action actions[SENSEACT_SHARED_SIZE];
+};
+
+/*
+ * Acknowledgements reported by the device. They are collected up to the
+ * sync of their write and held back while a frame of the sensor stream
+ * is open, so that the two streams never share the staging area of a
+ * queue. @ready counts the actions of complete ack frames, @dropping
+ * marks an ack frame which did not fit and is dropped up to its sync.
+ */
+struct senseact_acks {
+	unsigned int count;
+	unsigned int ready;
+	int dropping;
+	struct senseact_shared_action actions[SENSEACT_ACK_SIZE];
+};
+
+/*
+ * Minors of the devices. Registered devices are looked up under RCU and
+ * hold a reference for the table, unregistered ones only reserve their
+ * minor until they are released.
+ */
+static DEFINE_IDR(senseact_idr);
+static DEFINE_MUTEX(senseact_idr_mutex);
+
+static struct cdev senseact_cdev;
+
+static inline int is_type_supported(struct senseact_device *senseact, unsigned int code)
+{
+	return code <= SENSEACT_TYPE_MAX && test_bit(code, senseact->types);
+}
+
+/*
+ * Account @n to a statistic of a queue and of its device.
+ */
+static inline void senseact_queue_stat_add(struct senseact_queue *queue,
+					   unsigned int stat, s64 n)
+{
+	atomic64_add(n, &queue->stats[stat]);
+	atomic64_add(n, &queue->senseact->stats[stat]);
+}
+
+static void senseact_get_stats(atomic64_t *counters,
+			       struct senseact_stats *stats)
+{
+	stats->actions = atomic64_read(&counters[SENSEACT_STAT_ACTIONS]);
+	stats->frames = atomic64_read(&counters[SENSEACT_STAT_FRAMES]);
+	stats->overruns = atomic64_read(&counters[SENSEACT_STAT_OVERRUNS]);
+	stats->wakeups = atomic64_read(&counters[SENSEACT_STAT_WAKEUPS]);
+	stats->read_bytes = atomic64_read(&counters[SENSEACT_STAT_READ_BYTES]);
+	stats->written = atomic64_read(&counters[SENSEACT_STAT_WRITTEN]);
+	stats->pass_ns = atomic64_read(&counters[SENSEACT_STAT_PASS_NS]);
+}
+
+static void senseact_get_capability(struct senseact_device *senseact,
+				    unsigned int type,
+				    struct senseact_capability *cap)
+{
+	memset(cap, 0, sizeof(struct senseact_capability));
+	cap->type = type;
+
+	if (is_type_supported(senseact, type)) {
+		cap->prefix = senseact->caps[type].prefix;
+		cap->unit = senseact->caps[type].unit;
+		cap->count = senseact->caps[type].count;
+	}
+}
+
+static int senseact_open_device(struct senseact_device *senseact)
+{
+	int retval;
+
+	retval = mutex_lock_interruptible(&senseact->mutex);
+	if (retval)
+		return retval;
+
+	if (senseact->going_away) {
+		retval = -ENODEV;
+	} else if (!senseact->users++ && senseact->open) {
+		retval = senseact->open(senseact);
+		if (retval)
+			senseact->users--;
+	}
+
+	mutex_unlock(&senseact->mutex);
+	return retval;
+}
+
+static void senseact_close_device(struct senseact_device *senseact)
+{
+	mutex_lock(&senseact->mutex);
+
+	if (!--senseact->users && senseact->close)
+		senseact->close(senseact);
+
+	mutex_unlock(&senseact->mutex);
+}
+
+/*
+ * Pass the shortest sample interval requested by the open files to the
+ * device. Called with the mutex of the device held.
+ */
+static void senseact_update_interval(struct senseact_device *senseact)
+{
+	struct senseact_queue *queue;
+	unsigned int interval = 0;
+
+	if (!senseact->set_interval || senseact->going_away)
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(queue, &senseact->queue_list, node)
+		if (queue->interval && (!interval || queue->interval < interval))
+			interval = queue->interval;
+	rcu_read_unlock();
+
+	senseact->set_interval(senseact, interval);
+}
+
+static int senseact_queue_set_interval(struct senseact_queue *queue,
+				       unsigned int interval)
+{
+	struct senseact_device *senseact = queue->senseact;
+
+	if (!senseact->set_interval)
+		return -ENOTTY;
+
+	if (interval)
+		interval = max(interval, senseact->min_interval);
+
+	queue->interval = interval;
+	senseact_update_interval(senseact);
+
+	return 0;
+}
+
+static void senseact_attach_queue(struct senseact_device *senseact,
+				struct senseact_queue *queue)
+{
+	spin_lock(&senseact->queue_lock);
+	list_add_tail_rcu(&queue->node, &senseact->queue_list);
+	spin_unlock(&senseact->queue_lock);
+	synchronize_rcu();
+}
+
+static void senseact_detach_queue(struct senseact_device *senseact,
+				struct senseact_queue *queue)
+{
+	spin_lock(&senseact->queue_lock);
+	list_del_rcu(&queue->node);
+	spin_unlock(&senseact->queue_lock);
+	synchronize_rcu();
+}
+
+static const unsigned int senseact_record_size[] = {
+	[SENSEACT_FORMAT_ACTION]	= sizeof(struct senseact_action),
+	[SENSEACT_FORMAT_EXT]		= sizeof(struct senseact_action_ext),
+};
+
+static inline size_t senseact_ring_bytes(unsigned int size, unsigned int format)
+{
+	return PAGE_ALIGN(sizeof(struct senseact_ring) +
+			  size * senseact_record_size[format]);
+}
+
+static struct senseact_ring *senseact_alloc_ring(unsigned int size,
+						 unsigned int format)
+{
+	struct senseact_ring *ring;
+
+	ring = vmalloc_user(senseact_ring_bytes(size, format));
+	if (!ring)
+		return NULL;
+
+	ring->size = size;
+	ring->offset = sizeof(struct senseact_ring);
+	ring->record_size = senseact_record_size[format];
+
+	return ring;
+}
+
+static void senseact_queue_set_ring(struct senseact_queue *queue,
+				    struct senseact_ring *ring, unsigned int format,
+				    unsigned int head)
+{
+	ring->head = head;
+	ring->overruns = queue->overruns;
+
+	rcu_assign_pointer(queue->ring, ring);
+	queue->buffer = (char *)ring + ring->offset;
+	queue->size = ring->size;
+	queue->format = format;
+	queue->record_size = senseact_record_size[format];
+	queue->head = head;
+}
+
+/*
+ * The tail is written by the reader and may live in a user mapping, so
+ * never trust it to be within the ring. The head is read with acquire
+ * semantics, so the actions before it are visible as well.
+ */
+static inline unsigned int senseact_queue_count(struct senseact_queue *queue)
+{
+	return min(smp_load_acquire(&queue->head) - ACCESS_ONCE(queue->ring->tail),
+		   queue->size);
+}
+
+/*
+ * Number of actions available to the reader, from the own ring or from
+ * the shared ring of the device.
+ */
+static inline unsigned int senseact_queue_avail(struct senseact_queue *queue)
+{
+	struct senseact_shared *shared;
+
+	if (!(queue->flags & SENSEACT_FLAG_SHARED))
+		return senseact_queue_count(queue);
+
+	shared = queue->senseact->shared;
+	return min_t(unsigned int,
+		     smp_load_acquire(&shared->head) - queue->cursor,
+		     SENSEACT_SHARED_SIZE);
+}
+
+/*
+ * A queue is ready for the reader once it holds at least the low
+ * watermark of actions, or as many as it can hold. The policies keep
+ * frames whole, so the own ring is full as soon as the next frame does
+ * not fit anymore, and a LATEST queue never holds more than one frame.
+ */
+static inline int senseact_queue_ready(struct senseact_queue *queue)
+{
+	unsigned int avail = senseact_queue_avail(queue);
+
+	if (queue->flags & SENSEACT_FLAG_SHARED)
+		return avail >= min_t(unsigned int, ACCESS_ONCE(queue->lowat),
+				      SENSEACT_SHARED_SIZE);
+
+	if (avail >= ACCESS_ONCE(queue->lowat))
+		return 1;
+
+	return avail && (queue->policy == SENSEACT_POLICY_LATEST ||
+			 queue->size - avail < ACCESS_ONCE(queue->frame_len));
+}
+
+/*
+ * Readers checking the queue without the read mutex may race with a
+ * replacement of the ring, which is only freed after a grace period.
+ */
+static unsigned int senseact_queue_check_avail(struct senseact_queue *queue)
+{
+	unsigned int avail;
+
+	rcu_read_lock();
+	avail = senseact_queue_avail(queue);
+	rcu_read_unlock();
+
+	return avail;
+}
+
+static int senseact_queue_check_ready(struct senseact_queue *queue)
+{
+	int ready;
+
+	rcu_read_lock();
+	ready = senseact_queue_ready(queue);
+	rcu_read_unlock();
+
+	return ready;
+}
+
+static inline unsigned int senseact_queue_space(struct senseact_queue *queue)
+{
+	return queue->size - min(senseact_queue_count(queue) + queue->pending,
+				 queue->size);
+}
+
+/*
+ * Both record formats start with a struct senseact_action, so a slot can
+ * always be accessed as such.
+ */
+static inline struct senseact_action *senseact_queue_slot(struct senseact_queue *queue,
+							  unsigned int n)
+{
+	return (struct senseact_action *)
+		(queue->buffer + (n & (queue->size - 1)) * queue->record_size);
+}
+
+static inline void senseact_queue_copy(struct senseact_queue *queue,
+				       struct senseact_action *dst,
+				       const void *src)
+{
+	memcpy(dst, src, queue->record_size);
+}
+
+/*
+ * Forget about staged actions and the state of the current frame, so
+ * that the queue restarts with the next frame.
+ */
+static void senseact_queue_reset_frame(struct senseact_queue *queue)
+{
+	queue->pending = 0;
+	queue->frame_count = 0;
+	queue->dropping = 0;
+}
+
+/*
+ * Replace the ring of a queue by one with @size records of @format.
+ * Queued and staged actions are carried over; if they do not fit the
+ * oldest ones are dropped and accounted as overruns. The old ring is
+ * freed once the readers checking it without the read mutex are done.
+ */
+static int senseact_queue_realloc(struct senseact_queue *queue,
+				  unsigned int size, unsigned int format)
+{
+	struct senseact_ring *ring, *old;
+	char *buffer;
+	unsigned int n, pending, i, tail, record_size;
+	int retval = 0;
+
+	if (!is_power_of_2(size) || size > SENSEACT_BUFFER_MAX ||
+	    format > SENSEACT_FORMAT_MAX)
+		return -EINVAL;
+
+	ring = senseact_alloc_ring(size, format);
+	if (!ring)
+		return -ENOMEM;
+
+	buffer = (char *)ring + ring->offset;
+	record_size = ring->record_size;
+
+	mutex_lock(&queue->read_mutex);
+
+	if (atomic_read(&queue->mapped)) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	spin_lock_irq(&queue->senseact->action_lock);
+
+	old = queue->ring;
+	pending = min(queue->pending, size);
+	n = senseact_queue_count(queue);
+	tail = queue->head - n;
+	if (n + pending > size) {
+		queue->overruns += n + pending - size;
+		tail += n + pending - size;
+		n = size - pending;
+	}
+
+	/* the new ring is zeroed, so extended records start without time */
+	for (i = 0; i < n + pending; i++)
+		memcpy(buffer + i * record_size, senseact_queue_slot(queue, tail + i),
+		       min(record_size, queue->record_size));
+
+	senseact_queue_set_ring(queue, ring, format, n);
+	queue->pending = pending;
+
+	spin_unlock_irq(&queue->senseact->action_lock);
+	mutex_unlock(&queue->read_mutex);
+
+	synchronize_rcu();
+	vfree(old);
+	return 0;
+
+ out:
+	mutex_unlock(&queue->read_mutex);
+	vfree(ring);
+	return retval;
+}
+
+static int senseact_queue_set_clock(struct senseact_queue *queue, int clkid)
+{
+	unsigned int clock;
+
+	switch (clkid) {
+	case CLOCK_MONOTONIC:
+		clock = SENSEACT_CLK_MONO;
+		break;
+	case CLOCK_REALTIME:
+		clock = SENSEACT_CLK_REAL;
+		break;
+	case CLOCK_BOOTTIME:
+		clock = SENSEACT_CLK_BOOT;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	queue->clock = clock;
+	return 0;
+}
+
+/*
+ * The shared ring is allocated for the first queue entering shared mode
+ * and kept until the device is released. Called with the device mutex
+ * held.
+ */
+static int senseact_alloc_shared(struct senseact_device *senseact)
+{
+	struct senseact_shared *shared;
+
+	if (senseact->shared)
+		return 0;
+
+	shared = kzalloc(sizeof(struct senseact_shared), GFP_KERNEL);
+	if (!shared)
+		return -ENOMEM;
+
+	rcu_assign_pointer(senseact->shared, shared);
+	return 0;
+}
+
+static int senseact_queue_set_flags(struct senseact_queue *queue,
+				    unsigned int flags)
+{
+	struct senseact_device *senseact = queue->senseact;
+	unsigned int shared = (flags ^ queue->flags) & SENSEACT_FLAG_SHARED;
+	int retval = 0;
+
+	if (flags & ~SENSEACT_FLAG_MASK)
+		return -EINVAL;
+
+	mutex_lock(&queue->read_mutex);
+
+	if (shared && (flags & SENSEACT_FLAG_SHARED)) {
+		if (atomic_read(&queue->mapped)) {
+			retval = -EBUSY;
+			goto out;
+		}
+
+		retval = senseact_alloc_shared(senseact);
+		if (retval)
+			goto out;
+	}
+
+	spin_lock_irq(&senseact->action_lock);
+
+	/* frames are delimited by their syncs */
+	if ((flags & SENSEACT_FLAG_FRAME) &&
+	    !(queue->filter.types & SENSEACT_TYPE_BIT(SENSEACT_TYPE_SYNC))) {
+		spin_unlock_irq(&senseact->action_lock);
+		retval = -EINVAL;
+		goto out;
+	}
+
+	if (shared && (flags & SENSEACT_FLAG_SHARED)) {
+		/* start with the next frame and forget the own ring */
+		queue->cursor = senseact->shared->head;
+		queue->ring->tail = queue->head;
+		atomic_inc(&senseact->shared_users);
+	} else if (shared) {
+		atomic_dec(&senseact->shared_users);
+	}
+
+	queue->flags = flags;
+	senseact_queue_reset_frame(queue);
+	spin_unlock_irq(&senseact->action_lock);
+
+ out:
+	mutex_unlock(&queue->read_mutex);
+	return retval;
+}
+
+static int senseact_queue_set_lowat(struct senseact_queue *queue,
+				    unsigned int lowat)
+{
+	if (lowat > SENSEACT_BUFFER_MAX)
+		return -EINVAL;
+
+	queue->lowat = max(lowat, 1U);
+
+	/* a lower watermark may make the queue ready */
+	wake_up_interruptible(&queue->senseact->wait);
+	return 0;
+}
+
+static int senseact_queue_set_filter(struct senseact_queue *queue,
+				     struct senseact_filter *filter)
+{
+	if (filter->index_min > filter->index_max ||
+	    (filter->flags & ~SENSEACT_FILTER_MASK) ||
+	    filter->flags == SENSEACT_FILTER_MASK)
+		return -EINVAL;
+
+	spin_lock_irq(&queue->senseact->action_lock);
+
+	if ((queue->flags & SENSEACT_FLAG_FRAME) &&
+	    !(filter->types & SENSEACT_TYPE_BIT(SENSEACT_TYPE_SYNC))) {
+		spin_unlock_irq(&queue->senseact->action_lock);
+		return -EINVAL;
+	}
+
+	queue->filter = *filter;
+	spin_unlock_irq(&queue->senseact->action_lock);
+
+	return 0;
+}
+
+static int senseact_queue_set_policy(struct senseact_queue *queue,
+				     unsigned int policy)
+{
+	int retval = 0;
+
+	if (policy > SENSEACT_POLICY_MAX)
+		return -EINVAL;
+
+	mutex_lock(&queue->read_mutex);
+
+	if (policy != SENSEACT_POLICY_DROP_NEWEST &&
+	    atomic_read(&queue->mapped)) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	spin_lock_irq(&queue->senseact->action_lock);
+	queue->policy = policy;
+	senseact_queue_reset_frame(queue);
+	spin_unlock_irq(&queue->senseact->action_lock);
+
+ out:
+	mutex_unlock(&queue->read_mutex);
+	return retval;
+}
+
+/*
+ * Check a frame program: every instruction has to be known and refer to
+ * valid operands, jumps have to stay within the program and the last
+ * instruction has to return. Reserved fields are kept zero for later
+ * extensions.
+ */
+static int senseact_prog_check(struct senseact_insn *insns, unsigned int len)
+{
+	struct senseact_insn *insn;
+	unsigned int pc, left;
+
+	if (insns[len - 1].code != SENSEACT_OP_RET)
+		return -EINVAL;
+
+	for (pc = 0; pc < len; pc++) {
+		insn = &insns[pc];
+		left = len - pc - 1;
+
+		if (insn->reserved)
+			return -EINVAL;
+
+		switch (insn->code) {
+		case SENSEACT_OP_LD:
+		case SENSEACT_OP_ST:
+		case SENSEACT_OP_DEL:
+		case SENSEACT_OP_MAX:
+		case SENSEACT_OP_MIN:
+			if (insn->type == SENSEACT_TYPE_SYNC ||
+			    insn->type > SENSEACT_TYPE_MAX)
+				return -EINVAL;
+			break;
+
+		case SENSEACT_OP_LDM:
+		case SENSEACT_OP_STM:
+		case SENSEACT_OP_ADDM:
+		case SENSEACT_OP_SUBM:
+			if (insn->k < 0 || insn->k >= SENSEACT_PROG_MEM)
+				return -EINVAL;
+			break;
+
+		case SENSEACT_OP_DIV:
+		case SENSEACT_OP_MOD:
+			if (insn->k <= 0)
+				return -EINVAL;
+			break;
+
+		case SENSEACT_OP_JA:
+			if (insn->k < 0 || insn->k >= left)
+				return -EINVAL;
+			break;
+
+		case SENSEACT_OP_JEQ:
+		case SENSEACT_OP_JGT:
+		case SENSEACT_OP_JGE:
+			if (insn->jt >= left || insn->jf >= left)
+				return -EINVAL;
+			break;
+
+		case SENSEACT_OP_LDK:
+		case SENSEACT_OP_ADD:
+		case SENSEACT_OP_SUB:
+		case SENSEACT_OP_MUL:
+		case SENSEACT_OP_ABS:
+		case SENSEACT_OP_RET:
+			break;
+
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int senseact_queue_set_prog(struct senseact_queue *queue,
+				   struct senseact_prog *uprog)
+{
+	struct senseact_frame_prog *prog = NULL, *old;
+	int retval;
+
+	if (uprog->len > SENSEACT_PROG_MAX || uprog->reserved)
+		return -EINVAL;
+
+	if (uprog->len) {
+		prog = kzalloc(sizeof(struct senseact_frame_prog) +
+			       uprog->len * sizeof(struct senseact_insn),
+			       GFP_KERNEL);
+		if (!prog)
+			return -ENOMEM;
+
+		prog->len = uprog->len;
+
+		if (copy_from_user(prog->insns,
+				   (void __user *)(unsigned long)uprog->insns,
+				   prog->len * sizeof(struct senseact_insn))) {
+			retval = -EFAULT;
+			goto err_free;
+		}
+
+		retval = senseact_prog_check(prog->insns, prog->len);
+		if (retval)
+			goto err_free;
+	}
+
+	spin_lock_irq(&queue->senseact->action_lock);
+	old = queue->prog;
+	queue->prog = prog;
+	spin_unlock_irq(&queue->senseact->action_lock);
+
+	kfree(old);
+	return 0;
+
+ err_free:
+	kfree(prog);
+	return retval;
+}
+
+/*
+ * Stage an action behind the head. Staged actions are not visible to the
+ * reader until they are published.
+ */
+static int senseact_queue_stage(struct senseact_queue *queue,
+				struct senseact_action_ext *action)
+{
+	if (!senseact_queue_space(queue))
+		return 0;
+
+	senseact_queue_copy(queue,
+		senseact_queue_slot(queue, queue->head + queue->pending++), action);
+	return 1;
+}
+
+static void senseact_queue_publish(struct senseact_queue *queue)
+{
+	unsigned int head = queue->head + queue->pending;
+
+	/* publish the actions before the new head */
+	smp_store_release(&queue->head, head);
+	smp_store_release(&queue->ring->head, head);
+	queue->pending = 0;
+}
+
+/*
+ * In frame mode, or with a frame program, the actions stay staged until
+ * the sync completes the frame, so the reader only ever sees complete
+ * frames. So does the first frame, whose length is not known yet.
+ */
+static inline int senseact_queue_staging(struct senseact_queue *queue)
+{
+	return (queue->flags & SENSEACT_FLAG_FRAME) || queue->prog ||
+	       !queue->frame_len;
+}
+
+static void senseact_queue_commit(struct senseact_queue *queue, int sync)
+{
+	if (sync || !senseact_queue_staging(queue))
+		senseact_queue_publish(queue);
+}
+
+static struct senseact_action *senseact_queue_find(struct senseact_queue *queue,
+						   unsigned int start, unsigned int count,
+						   unsigned int type, unsigned int index)
+{
+	struct senseact_action *slot;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		slot = senseact_queue_slot(queue, start + i);
+		if (slot->type == type && slot->index == index)
+			return slot;
+	}
+
+	return NULL;
+}
+
+/*
+ * Run a frame program on the staged actions of a queue. Returns whether
+ * the frame is kept.
+ */
+static int senseact_prog_run(struct senseact_queue *queue,
+			     struct senseact_frame_prog *prog)
+{
+	unsigned int head = queue->head, pending = queue->pending;
+	struct senseact_action *slot;
+	struct senseact_insn *insn;
+	unsigned int pc = 0, i;
+	int found;
+	s32 a = 0;
+
+	/* jumps only go forward and the last instruction returns */
+	for (;;) {
+		insn = &prog->insns[pc++];
+
+		switch (insn->code) {
+		case SENSEACT_OP_LD:
+			slot = senseact_queue_find(queue, head, pending,
+						   insn->type, insn->index);
+			a = slot ? slot->value : insn->k;
+			break;
+
+		case SENSEACT_OP_LDK:
+			a = insn->k;
+			break;
+
+		case SENSEACT_OP_LDM:
+			a = prog->mem[insn->k];
+			break;
+
+		case SENSEACT_OP_STM:
+			prog->mem[insn->k] = a;
+			break;
+
+		case SENSEACT_OP_ST:
+			slot = senseact_queue_find(queue, head, pending,
+						   insn->type, insn->index);
+			if (slot)
+				slot->value = a;
+			break;
+
+		case SENSEACT_OP_DEL:
+			slot = senseact_queue_find(queue, head, pending,
+						   insn->type, insn->index);
+			if (slot)
+				slot->type = SENSEACT_TYPE_DELETED;
+			break;
+
+		case SENSEACT_OP_MAX:
+		case SENSEACT_OP_MIN:
+			found = 0;
+			for (i = 0; i < pending; i++) {
+				slot = senseact_queue_slot(queue, head + i);
+				if (slot->type != insn->type)
+					continue;
+				if (!found++ ||
+				    (insn->code == SENSEACT_OP_MAX ?
+				     slot->value > a : slot->value < a))
+					a = slot->value;
+			}
+			if (!found)
+				a = insn->k;
+			break;
+
+		case SENSEACT_OP_ADD:
+			a = (u32)a + (u32)insn->k;
+			break;
+
+		case SENSEACT_OP_SUB:
+			a = (u32)a - (u32)insn->k;
+			break;
+
+		case SENSEACT_OP_MUL:
+			a = (u32)a * (u32)insn->k;
+			break;
+
+		case SENSEACT_OP_DIV:
+			a /= insn->k;
+			break;
+
+		case SENSEACT_OP_MOD:
+			a %= insn->k;
+			break;
+
+		case SENSEACT_OP_ADDM:
+			a = (u32)a + (u32)prog->mem[insn->k];
+			break;
+
+		case SENSEACT_OP_SUBM:
+			a = (u32)a - (u32)prog->mem[insn->k];
+			break;
+
+		case SENSEACT_OP_ABS:
+			if (a < 0)
+				a = -(u32)a;
+			break;
+
+		case SENSEACT_OP_JA:
+			pc += insn->k;
+			break;
+
+		case SENSEACT_OP_JEQ:
+			pc += a == insn->k ? insn->jt : insn->jf;
+			break;
+
+		case SENSEACT_OP_JGT:
+			pc += a > insn->k ? insn->jt : insn->jf;
+			break;
+
+		case SENSEACT_OP_JGE:
+			pc += a >= insn->k ? insn->jt : insn->jf;
+			break;
+
+		default:	/* SENSEACT_OP_RET */
+			return insn->k != 0;
+		}
+	}
+}
+
+/*
+ * Called on the sync of a frame before it is staged. Runs the frame
+ * program of the queue, if any, and squeezes the deleted actions out of
+ * the staged ones. A dropped frame is discarded as a whole.
+ */
+static int senseact_queue_keep_frame(struct senseact_queue *queue)
+{
+	struct senseact_action *slot;
+	unsigned int head = queue->head;
+	unsigned int i, n;
+
+	if (!queue->prog)
+		return 1;
+
+	if (!senseact_prog_run(queue, queue->prog)) {
+		queue->pending = 0;
+		return 0;
+	}
+
+	for (i = 0, n = 0; i < queue->pending; i++) {
+		slot = senseact_queue_slot(queue, head + i);
+		if (slot->type == SENSEACT_TYPE_DELETED)
+			continue;
+		if (n != i)
+			senseact_queue_copy(queue,
+				senseact_queue_slot(queue, head + n), slot);
+		n++;
+	}
+
+	queue->pending = n;
+	return 1;
+}
+
+/*
+ * Number of actions in the complete frames among the first @n actions
+ * behind @tail.
+ */
+static unsigned int senseact_queue_frames(struct senseact_queue *queue,
+					  unsigned int tail, unsigned int n)
+{
+	while (n && senseact_queue_slot(queue, tail + n - 1)->type != SENSEACT_TYPE_SYNC)
+		n--;
+
+	return n;
+}
+
+/*
+ * Move the tail to @tail on behalf of the reader. Returns the number of
+ * actions dropped that way.
+ */
+static unsigned int senseact_queue_drop_until(struct senseact_queue *queue,
+					      unsigned int tail)
+{
+	struct senseact_ring *ring = queue->ring;
+	unsigned int old;
+
+	do {
+		old = ACCESS_ONCE(ring->tail);
+		if ((int)(tail - old) <= 0)
+			return 0;
+	} while (cmpxchg(&ring->tail, old, tail) != old);
+
+	return tail - old;
+}
+
+/*
+ * Drop the oldest complete frame of the queue. Returns the number of
+ * dropped actions, 0 if the queue holds no complete frame.
+ */
+static unsigned int senseact_queue_drop_frame(struct senseact_queue *queue)
+{
+	unsigned int tail, n, i;
+
+	tail = ACCESS_ONCE(queue->ring->tail);
+	n = senseact_queue_count(queue);
+
+	for (i = 0; i < n; i++)
+		if (senseact_queue_slot(queue, tail + i)->type == SENSEACT_TYPE_SYNC)
+			return senseact_queue_drop_until(queue, tail + i + 1);
+
+	return 0;
+}
+
+/*
+ * SENSEACT_POLICY_DROP_NEWEST: a frame which does not fit into the queue
+ * is dropped up to and including its sync. Whether a frame fits is
+ * decided at its start by means of the longest frame seen so far. While
+ * staging, the already staged part of the frame is dropped, too. A frame
+ * which is published as it comes in and turns out longer than expected
+ * is cut off, but always keeps room for its sync, so that it never runs
+ * into the next frame.
+ */
+static unsigned int senseact_queue_drop_newest(struct senseact_queue *queue,
+					       struct senseact_action_ext *action,
+					       int store)
+{
+	int sync = action->type == SENSEACT_TYPE_SYNC;
+	unsigned int dropped;
+
+	if (sync && !queue->dropping && !senseact_queue_keep_frame(queue))
+		return 0;
+
+	if (!queue->dropping && !queue->frame_count &&
+	    senseact_queue_space(queue) < min(queue->frame_len, queue->size))
+		queue->dropping = 1;
+
+	if (!queue->dropping && !sync && !senseact_queue_staging(queue) &&
+	    senseact_queue_space(queue) <= 1)
+		return 1;
+
+	if (!queue->dropping && store && !senseact_queue_stage(queue, action))
+		queue->dropping = 1;
+
+	if (queue->dropping) {
+		dropped = store + queue->pending;
+		queue->pending = 0;
+		queue->dropping = !sync;
+		return dropped;
+	}
+
+	senseact_queue_commit(queue, sync);
+	return 0;
+}
+
+/*
+ * SENSEACT_POLICY_DROP_OLDEST: make room by dropping complete frames from
+ * the tail. A single frame larger than the queue is cut off.
+ */
+static unsigned int senseact_queue_drop_oldest(struct senseact_queue *queue,
+					       struct senseact_action_ext *action,
+					       int store)
+{
+	unsigned int dropped = 0, n;
+
+	if (action->type == SENSEACT_TYPE_SYNC &&
+	    !senseact_queue_keep_frame(queue))
+		return 0;
+
+	while (store && !senseact_queue_space(queue)) {
+		n = senseact_queue_drop_frame(queue);
+		if (!n)
+			break;
+		dropped += n;
+	}
+
+	if (store && !senseact_queue_stage(queue, action))
+		return dropped + 1;
+
+	senseact_queue_commit(queue, action->type == SENSEACT_TYPE_SYNC);
+	return dropped;
+}
+
+/*
+ * SENSEACT_POLICY_LATEST: the queue holds a single frame with the latest
+ * value of every channel. The actions of a new frame are staged and
+ * merged with the queued frame on its sync: channels the new frame does
+ * not update are carried over, the others are replaced. The merged frame
+ * is written behind the queued one, so a reader copying the queued frame
+ * never sees it change; the reader just loses the race for the tail.
+ */
+static unsigned int senseact_queue_coalesce(struct senseact_queue *queue,
+					    struct senseact_action_ext *action,
+					    int store)
+{
+	struct senseact_action *slot;
+	unsigned int head = queue->head, pending = queue->pending;
+	unsigned int tail, n, carry, i, j;
+
+	if (action->type != SENSEACT_TYPE_SYNC) {
+		slot = senseact_queue_find(queue, head, pending,
+					   action->type, action->index);
+		if (slot) {
+			senseact_queue_copy(queue, slot, action);
+			return 0;
+		}
+
+		if (senseact_queue_stage(queue, action))
+			return 0;
+
+		/* the staged frame has precedence over the queued one */
+		senseact_queue_drop_until(queue, head);
+		return !senseact_queue_stage(queue, action);
+	}
+
+	if (!senseact_queue_keep_frame(queue))
+		return 0;
+
+	tail = ACCESS_ONCE(queue->ring->tail);
+	n = senseact_queue_count(queue);
+
+	carry = 0;
+	for (i = 0; i < n; i++) {
+		slot = senseact_queue_slot(queue, tail + i);
+		if (slot->type != SENSEACT_TYPE_SYNC &&
+		    !senseact_queue_find(queue, head, pending,
+					 slot->type, slot->index))
+			carry++;
+	}
+
+	if (n + carry + pending + store > queue->size) {
+		senseact_queue_drop_until(queue, head);
+		n = carry = 0;
+	}
+
+	/* move the staged actions behind the carried ones */
+	if (carry) {
+		for (j = pending; j-- > 0;)
+			senseact_queue_copy(queue,
+				senseact_queue_slot(queue, head + carry + j),
+				senseact_queue_slot(queue, head + j));
+
+		for (i = 0, j = 0; i < n; i++) {
+			slot = senseact_queue_slot(queue, tail + i);
+			if (slot->type != SENSEACT_TYPE_SYNC &&
+			    !senseact_queue_find(queue, head + carry, pending,
+						 slot->type, slot->index))
+				senseact_queue_copy(queue,
+					senseact_queue_slot(queue, head + j++), slot);
+		}
 
-#define SENSEACT_BUFFER_SIZE	64
+		queue->pending += carry;
+	}
 
+	if (store && !senseact_queue_stage(queue, action))
+		return 1;
 
-struct senseact_queue {
-	struct senseact_action buffer[SENSEACT_BUFFER_SIZE];
-	int head;
-	int tail;
-	spinlock_t buffer_lock;
-	struct fasync_struct *fasync;
-	struct senseact_device *senseact;
-	struct list_head node;
-};
+	/* the merged frame replaces the queued one */
+	smp_wmb();
+	senseact_queue_drop_until(queue, head);
+	senseact_queue_publish(queue);
 
-static struct senseact_device *senseact_table[SENSEACT_DEVICES];
-static DEFINE_MUTEX(senseact_table_mutex);
+	return 0;
+}
 
-static inline int is_type_supported(struct senseact_device *senseact, unsigned int code)
+/*
+ * Insert an action according to the queue policy. A sync which the queue
+ * filters is passed with @store cleared: it ends the frame all the same,
+ * but is not queued itself.
+ */
+static void senseact_queue_insert_action(struct senseact_queue *queue,
+			     struct senseact_action_ext *action, int store)
 {
-	return code <= SENSEACT_TYPE_MAX && test_bit(code, senseact->types);
+	struct senseact_device *senseact = queue->senseact;
+	unsigned int dropped;
+
+	switch (queue->policy) {
+	case SENSEACT_POLICY_DROP_OLDEST:
+		dropped = senseact_queue_drop_oldest(queue, action, store);
+		break;
+
+	case SENSEACT_POLICY_LATEST:
+		dropped = senseact_queue_coalesce(queue, action, store);
+		break;
+
+	default:
+		dropped = senseact_queue_drop_newest(queue, action, store);
+		break;
+	}
+
+	if (action->type == SENSEACT_TYPE_SYNC) {
+		queue->frame_len = max(queue->frame_len,
+				       queue->frame_count + store);
+		queue->frame_count = 0;
+	} else {
+		queue->frame_count++;
+	}
+
+	if (dropped) {
+		queue->overruns += dropped;
+		queue->ring->overruns = queue->overruns;
+	}
+
+	/* keep the fill level off the hot path while tracing is off */
+	if (trace_senseact_queue_insert_enabled())
+		trace_senseact_queue_insert(senseact, action,
+					    senseact_queue_count(queue) +
+					    queue->pending, dropped);
+
+	if (dropped) {
+		senseact_queue_stat_add(queue, SENSEACT_STAT_OVERRUNS, dropped);
+
+		dev_warn_ratelimited(&senseact->dev,
+				     "buffer overrun on device %s\n",
+				     senseact->name);
+	}
 }
 
-static int senseact_open_device(struct senseact_device *senseact)
+/*
+ * Send SIGIO at the end of a frame, or of every batch in eager mode, if
+ * the queue is ready. Returns whether the readers have to be woken up.
+ */
+static int senseact_queue_notify(struct senseact_queue *queue,
+				 unsigned int type)
 {
-	int retval;
+	if (type != SENSEACT_TYPE_SYNC && !(queue->flags & SENSEACT_FLAG_EAGER))
+		return 0;
 
-	retval = mutex_lock_interruptible(&senseact->mutex);
-	if (retval)
-		return retval;
+	if (!senseact_queue_ready(queue))
+		return 0;
 
-	if (senseact->going_away) {
-		retval = -ENODEV;
-	} else if (!senseact->users++ && senseact->open) {
-		retval = senseact->open(senseact);
-		if (retval)
-			senseact->users--;
+	kill_fasync(&queue->fasync, SIGIO, POLL_IN);
+	atomic64_inc(&queue->stats[SENSEACT_STAT_WAKEUPS]);
+	return 1;
+}
+
+/*
+ * Check whether a queue subscribed to @count actions of @type starting
+ * at @index and clip them to the index range of its filter. Syncs are
+ * only subject to the type mask.
+ */
+static int senseact_queue_subscribed(struct senseact_queue *queue,
+				     unsigned int type, unsigned int index,
+				     unsigned int count, unsigned int *first,
+				     unsigned int *last)
+{
+	struct senseact_filter *filter = &queue->filter;
+
+	if (!(filter->types & SENSEACT_TYPE_BIT(type)))
+		return 0;
+
+	*first = 0;
+	*last = count;
+
+	if (type != SENSEACT_TYPE_SYNC) {
+		if (index < filter->index_min)
+			*first = min(filter->index_min - index, count);
+		if (index + count > filter->index_max + 1)
+			*last = max_t(int, filter->index_max + 1 - index, *first);
 	}
 
-	mutex_unlock(&senseact->mutex);
-	return retval;
+	return *first < *last;
 }
 
-static void senseact_close_device(struct senseact_device *senseact)
+/*
+ * Take the timestamps of a new frame. All actions up to the next sync
+ * share them together with the frame sequence number.
+ */
+static void senseact_stamp_at(ktime_t *time, ktime_t mono)
 {
-	mutex_lock(&senseact->mutex);
+	time[SENSEACT_CLK_MONO] = mono;
+	time[SENSEACT_CLK_REAL] = ktime_mono_to_real(mono);
+	time[SENSEACT_CLK_BOOT] = ktime_mono_to_any(mono, TK_OFFS_BOOT);
+}
 
-	if (!--senseact->users && senseact->close)
-		senseact->close(senseact);
+static void senseact_stamp(ktime_t *time)
+{
+	senseact_stamp_at(time, ktime_get());
+}
 
-	mutex_unlock(&senseact->mutex);
+static void senseact_stamp_frame(struct senseact_device *senseact)
+{
+	senseact_stamp(senseact->frame_time);
+	senseact->sequence++;
+	senseact->frame_open = 1;
 }
 
-static void senseact_attach_queue(struct senseact_device *senseact,
-				struct senseact_queue *queue)
+/*
+ * Store actions once in the shared ring of the device.
+ */
+static void senseact_shared_insert(struct senseact_device *senseact,
+				   struct senseact_shared *shared,
+				   struct senseact_action_ext *action,
+				   unsigned int index, unsigned int count,
+				   int *values)
 {
-	spin_lock(&senseact->queue_lock);
-	list_add_tail_rcu(&queue->node, &senseact->queue_list);
-	spin_unlock(&senseact->queue_lock);
-	synchronize_rcu();
+	struct senseact_shared_action *slot;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		slot = &shared->actions[shared->next & (SENSEACT_SHARED_SIZE - 1)];
+
+		/* claim the slot before it is overwritten */
+		shared->next++;
+		smp_wmb();
+
+		slot->action.type = action->type;
+		slot->action.prefix = action->prefix;
+		slot->action.unit = action->unit;
+		slot->action.index = index + i;
+		slot->action.value = action->type == SENSEACT_TYPE_SYNC ?
+			action->value : values[i];
+		slot->sequence = action->sequence;
+		memcpy(slot->time, senseact->frame_time, sizeof(slot->time));
+	}
+
+	if (action->type == SENSEACT_TYPE_SYNC)
+		smp_store_release(&shared->head, shared->next);
 }
 
-static void senseact_detach_queue(struct senseact_device *senseact,
-				struct senseact_queue *queue)
+/*
+ * Remember the latest values of the device. Values of the sensor stream
+ * are staged and published together with the time and sequence of their
+ * frame at its sync, so a snapshot never mixes two frames. Ack frames
+ * are passed between the sensor frames and published by their own sync,
+ * which keeps the time and sequence of the last sensor frame.
+ */
+static void senseact_update_state(struct senseact_device *senseact, int ack,
+				  unsigned int type, unsigned int index,
+				  unsigned int count, int *values)
 {
-	spin_lock(&senseact->queue_lock);
-	list_del_rcu(&queue->node);
-	spin_unlock(&senseact->queue_lock);
-	synchronize_rcu();
+	unsigned int size = senseact->state_pending - senseact->state;
+	unsigned int offset = senseact->state_offset[type];
+	unsigned int n = senseact->caps[type].count;
+	unsigned int i;
+
+	if (type != SENSEACT_TYPE_SYNC) {
+		for (i = 0; i < count && index + i < n; i++)
+			senseact->state_pending[offset + index + i] = values[i];
+		return;
+	}
+
+	write_seqcount_begin(&senseact->state_seq);
+
+	memcpy(senseact->state, senseact->state_pending, size * sizeof(int));
+
+	if (!ack) {
+		memcpy(senseact->state_time, senseact->frame_time,
+		       sizeof(senseact->state_time));
+		senseact->state_sequence = senseact->sequence;
+	}
+
+	write_seqcount_end(&senseact->state_seq);
 }
 
-static void senseact_queue_insert_action(struct senseact_queue *queue,
-			     struct senseact_action *action)
+/*
+ * Acknowledgements are only passed to the queues asking for them, the
+ * sensor stream only to the ones not restricted to acknowledgements.
+ */
+static inline int senseact_queue_wants(struct senseact_queue *queue, int ack)
 {
-	struct senseact_device *senseact = queue->senseact;
+	return !(queue->filter.flags &
+		 (ack ? SENSEACT_FILTER_NO_ACK : SENSEACT_FILTER_ACK_ONLY));
+}
 
+/*
+ * Insert actions into the queues of a device. Called under RCU with the
+ * action lock held. Returns whether the readers have to be woken up.
+ */
+static int senseact_queue_actions(struct senseact_device *senseact, int ack,
+				  struct senseact_action_ext *action,
+				  ktime_t *time, unsigned int index,
+				  unsigned int count, int *values)
+{
+	struct senseact_queue *queue;
+	unsigned int type = action->type;
+	unsigned int first, last, i;
+	int wake = 0;
+
+	list_for_each_entry_rcu(queue, &senseact->queue_list, node) {
+		if (queue->flags & SENSEACT_FLAG_SHARED) {
+			if (!ack)
+				wake |= senseact_queue_notify(queue, type);
+			continue;
+		}
 
-	/*
-	 * Interrupts are disabled, just acquire the lock
-	 */
-	spin_lock(&queue->buffer_lock);
-	queue->buffer[queue->head++] = *action;
-	queue->head %= SENSEACT_BUFFER_SIZE;
-	spin_unlock(&queue->buffer_lock);
+		if (!senseact_queue_wants(queue, ack))
+			continue;
 
-	if (queue->head == queue->tail)
-		printk(KERN_ERR
-			"senseact_user: buffer overrun on device %s\n", senseact->name);
+		action->time = ktime_to_ns(time[queue->clock]);
 
-	kill_fasync(&queue->fasync, SIGIO, POLL_IN);
+		/* a sync ends the frame even for queues filtering it */
+		if (!senseact_queue_subscribed(queue, type, index, count,
+					       &first, &last)) {
+			if (type != SENSEACT_TYPE_SYNC)
+				continue;
+			senseact_queue_insert_action(queue, action, 0);
+			first = last = 0;
+		}
+
+		for (i = first; i < last; i++) {
+			action->index = index + i;
+			if (type != SENSEACT_TYPE_SYNC)
+				action->value = values[i];
+
+			senseact_queue_insert_action(queue, action, 1);
+		}
+
+		if (type == SENSEACT_TYPE_SYNC)
+			atomic64_add(last - first, &queue->stats[SENSEACT_STAT_FRAMES]);
+		else
+			atomic64_add(last - first, &queue->stats[SENSEACT_STAT_ACTIONS]);
+
+		wake |= senseact_queue_notify(queue, type);
+	}
+
+	return wake;
+}
+
+/*
+ * Collect acknowledgements of the current write. An ack frame which does
+ * not fit is dropped as a whole.
+ */
+static void senseact_hold_acks(struct senseact_device *senseact,
+			       struct senseact_action_ext *action,
+			       unsigned int index, unsigned int count,
+			       int *values)
+{
+	struct senseact_acks *acks = senseact->acks;
+	struct senseact_shared_action *slot;
+	unsigned int i;
+
+	for (i = 0; i < count && !acks->dropping; i++) {
+		if (acks->count == SENSEACT_ACK_SIZE) {
+			atomic64_add(acks->count - acks->ready + count - i,
+				     &senseact->stats[SENSEACT_STAT_OVERRUNS]);
+			acks->count = acks->ready;
+			acks->dropping = 1;
+			break;
+		}
+
+		slot = &acks->actions[acks->count++];
+		slot->action.type = action->type;
+		slot->action.prefix = action->prefix;
+		slot->action.unit = action->unit;
+		slot->action.index = index + i;
+		slot->action.value = action->type == SENSEACT_TYPE_SYNC ?
+			action->value : values[i];
+		slot->sequence = action->sequence;
+		memcpy(slot->time, senseact->ack_time, sizeof(slot->time));
+	}
+
+	if (action->type == SENSEACT_TYPE_SYNC) {
+		if (!acks->dropping)
+			acks->ready = acks->count;
+		acks->dropping = 0;
+	}
+}
+
+/*
+ * Pass the complete ack frames to the queues. Must not be called while
+ * a frame of the sensor stream is open. Returns whether the readers have
+ * to be woken up.
+ */
+static int senseact_release_acks(struct senseact_device *senseact)
+{
+	struct senseact_acks *acks = senseact->acks;
+	struct senseact_shared_action *slot;
+	struct senseact_action_ext action;
+	unsigned int i;
+	int wake = 0;
+
+	if (!acks || !acks->ready)
+		return 0;
+
+	for (i = 0; i < acks->ready; i++) {
+		slot = &acks->actions[i];
+
+		memset(&action, 0, sizeof(action));
+		action.type = slot->action.type;
+		action.prefix = slot->action.prefix;
+		action.unit = slot->action.unit;
+		action.value = slot->action.value;
+		action.sequence = slot->sequence;
+		action.flags = SENSEACT_ACTION_FLAG_ACK;
+
+		wake |= senseact_queue_actions(senseact, 1, &action, slot->time,
+					       slot->action.index, 1,
+					       &slot->action.value);
+
+		if (senseact->state)
+			senseact_update_state(senseact, 1, action.type,
+					      slot->action.index, 1,
+					      &slot->action.value);
+	}
+
+	/* keep the ack frame still being collected */
+	acks->count -= acks->ready;
+	memmove(acks->actions, acks->actions + acks->ready,
+		acks->count * sizeof(struct senseact_shared_action));
+	acks->ready = 0;
+
+	return wake;
 }
 
-static void senseact_handle_actions(struct senseact_device *senseact,
+static void senseact_handle_actions(struct senseact_device *senseact, int ack,
 			unsigned int type, unsigned int prefix, unsigned int index, unsigned int count, int *values)
 {
-	struct senseact_queue *queue;
-	struct senseact_action action;
-	int i;
+	struct senseact_action_ext action;
+	struct senseact_shared *shared;
+	int wake = 0;
+
+	memset(&action, 0, sizeof(action));
+	action.type = type;
+	action.prefix = prefix;
+	action.unit = senseact->caps[type].unit;
+
+	if (ack) {
+		action.sequence = senseact->ack_sequence;
+		action.flags = SENSEACT_ACTION_FLAG_ACK;
+		if (type == SENSEACT_TYPE_SYNC)
+			action.value = ktime_us_delta(ktime_get(),
+						      senseact->ack_issued);
+	} else {
+		if (!senseact->frame_open)
+			senseact_stamp_frame(senseact);
 
-	for (i = 0; i < count; i++) {
-		action.type = type;
-		action.prefix = prefix;
-		action.index = index + i;
-		if (action.type == SENSEACT_TYPE_SYNC)
+		action.sequence = senseact->sequence;
+		if (type == SENSEACT_TYPE_SYNC)
 			action.value = jiffies_to_msecs(jiffies);
-		else
-			action.value = values[i];
+	}
+
+	if (senseact->state && !ack)
+		senseact_update_state(senseact, 0, type, index, count, values);
+
+	rcu_read_lock();
+
+	if (ack) {
+		senseact_hold_acks(senseact, &action, index, count, values);
+		if (type == SENSEACT_TYPE_SYNC && !senseact->frame_open)
+			wake |= senseact_release_acks(senseact);
+	} else {
+		/* the shared ring only carries the sensor stream */
+		if (atomic_read(&senseact->shared_users)) {
+			shared = rcu_dereference(senseact->shared);
+			senseact_shared_insert(senseact, shared, &action,
+					       index, count, values);
+		}
 
-		rcu_read_lock();
+		wake |= senseact_queue_actions(senseact, 0, &action,
+					       senseact->frame_time,
+					       index, count, values);
 
-		list_for_each_entry_rcu(queue, &senseact->queue_list, node)
-			senseact_queue_insert_action(queue, &action);
+		/* acks held back by the frame follow it */
+		if (type == SENSEACT_TYPE_SYNC) {
+			senseact->frame_open = 0;
+			wake |= senseact_release_acks(senseact);
+		}
+	}
+
+	rcu_read_unlock();
+
+	if (type == SENSEACT_TYPE_SYNC)
+		atomic64_inc(&senseact->stats[SENSEACT_STAT_FRAMES]);
+	else
+		atomic64_add(count, &senseact->stats[SENSEACT_STAT_ACTIONS]);
 
-		rcu_read_unlock();
+	if (wake) {
+		atomic64_inc(&senseact->stats[SENSEACT_STAT_WAKEUPS]);
+		wake_up_interruptible(&senseact->wait);
 	}
+}
 
-	wake_up_interruptible(&senseact->wait);
+/*
+ * Pass actions to the device. Runs of actions with the same type and
+ * consecutive indices are handed over in a single call.
+ */
+static int senseact_pass_to_device(struct senseact_device *senseact,
+				   struct senseact_action *actions,
+				   int *values, unsigned int count)
+{
+	unsigned int start, i;
+	int retval;
+
+	for (start = 0; start < count; start = i) {
+		values[start] = actions[start].value;
+
+		for (i = start + 1; i < count; i++) {
+			if (actions[i].type != actions[start].type ||
+			    actions[i].index != actions[start].index + (i - start))
+				break;
+			values[i] = actions[i].value;
+		}
+
+		trace_senseact_write_pass(senseact, actions[start].type,
+					  actions[start].index, i - start);
+
+		retval = senseact->pass(senseact, actions[start].type,
+					actions[start].index, i - start,
+					values + start);
+		if (retval)
+			return retval;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply written actions issued at @issued and complete them with an
+ * actor sync. The actions the driver reports meanwhile from the calling
+ * task are acknowledgements. Called with the pass mutex held.
+ */
+static int senseact_apply(struct senseact_device *senseact,
+			  struct senseact_action *actions, int *values,
+			  unsigned int count, ktime_t issued)
+{
+	int retval, value = 0;
+
+	senseact_stamp(senseact->ack_time);
+	senseact->ack_issued = issued;
+	senseact->ack_sequence++;
+	senseact->pass_task = current;
+
+	retval = senseact_pass_to_device(senseact, actions, values, count);
+	if (!retval)
+		senseact->pass(senseact, SENSEACT_TYPE_SYNC, SENSEACT_SYNC_ACTOR, 1, &value);
+
+	senseact->pass_task = NULL;
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(),
+					   senseact->ack_time[SENSEACT_CLK_MONO])),
+		     &senseact->stats[SENSEACT_STAT_PASS_NS]);
+
+	trace_senseact_write(senseact, count, retval);
+	return retval;
+}
+
+/*
+ * Queue actions for the command worker of the device. An action replaces
+ * a queued one of the same type and index which was not applied yet.
+ * Returns the number of actions queued, which stops short when the
+ * command ring is full, or -ENODEV once the device is going away.
+ */
+static int senseact_queue_commands(struct senseact_device *senseact,
+				   struct senseact_action *actions,
+				   unsigned int count)
+{
+	struct senseact_action *commands = senseact->commands;
+	unsigned int i, j;
+
+	spin_lock(&senseact->command_lock);
+
+	/* checked under the lock, so that unregistering can fence us off */
+	if (senseact->going_away) {
+		spin_unlock(&senseact->command_lock);
+		return -ENODEV;
+	}
+
+	if (!senseact->command_count)
+		senseact->command_time = ktime_get();
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < senseact->command_count; j++)
+			if (commands[j].type == actions[i].type &&
+			    commands[j].index == actions[i].index)
+				break;
+
+		if (j == senseact->command_count) {
+			if (j == SENSEACT_COMMAND_MAX)
+				break;
+			senseact->command_count++;
+		}
+
+		commands[j] = actions[i];
+	}
+
+	if (i)
+		schedule_work(&senseact->command_work);
+
+	spin_unlock(&senseact->command_lock);
+
+	return i;
+}
+
+/*
+ * Apply the queued commands of a device. The driver reports them back
+ * through the read stream like the actions of a synchronous write.
+ */
+static void senseact_command_work(struct work_struct *work)
+{
+	struct senseact_device *senseact =
+		container_of(work, struct senseact_device, command_work);
+	struct senseact_action actions[SENSEACT_COMMAND_MAX];
+	int values[SENSEACT_COMMAND_MAX];
+	unsigned int count;
+	ktime_t issued;
+	int retval;
+
+	mutex_lock(&senseact->pass_mutex);
+
+	spin_lock(&senseact->command_lock);
+	count = senseact->command_count;
+	issued = senseact->command_time;
+	memcpy(actions, senseact->commands, count * sizeof(struct senseact_action));
+	senseact->command_count = 0;
+	spin_unlock(&senseact->command_lock);
+
+	if (!count || senseact->going_away)
+		goto out;
+
+	retval = senseact_apply(senseact, actions, values, count, issued);
+	if (retval)
+		dev_err_ratelimited(&senseact->dev,
+				    "failed to apply %u commands: %d\n",
+				    count, retval);
+
+ out:
+	mutex_unlock(&senseact->pass_mutex);
 }
 
 /**
@@ -176,8 +1759,95 @@ static struct attribute_group senseact_dev_attr_group = {
 	.attrs	= senseact_dev_attrs,
 };
 
+#define SENSEACT_DEV_CAP_ATTR_SHOW(name, type)				\
+static ssize_t senseact_dev_show_cap_##name(struct device *dev,		\
+					    struct device_attribute *attr, \
+					    char *buf)			\
+{									\
+	struct senseact_device *senseact = to_senseact_device(dev);	\
+	struct senseact_capability cap;					\
+									\
+	senseact_get_capability(senseact, type, &cap);			\
+	return scnprintf(buf, PAGE_SIZE, "%u %d %u\n",			\
+			 cap.count, cap.prefix, cap.unit);		\
+}									\
+static struct device_attribute dev_attr_cap_##name =			\
+	__ATTR(name, S_IRUGO, senseact_dev_show_cap_##name, NULL)
+
+SENSEACT_DEV_CAP_ATTR_SHOW(sync, SENSEACT_TYPE_SYNC);
+SENSEACT_DEV_CAP_ATTR_SHOW(brightness, SENSEACT_TYPE_BRIGHTNESS);
+SENSEACT_DEV_CAP_ATTR_SHOW(enable, SENSEACT_TYPE_ENABLE);
+SENSEACT_DEV_CAP_ATTR_SHOW(speed, SENSEACT_TYPE_SPEED);
+SENSEACT_DEV_CAP_ATTR_SHOW(position, SENSEACT_TYPE_POSITION);
+SENSEACT_DEV_CAP_ATTR_SHOW(angle, SENSEACT_TYPE_ANGLE);
+SENSEACT_DEV_CAP_ATTR_SHOW(increment, SENSEACT_TYPE_INCREMENT);
+
+static struct attribute *senseact_dev_cap_attrs[] = {
+	&dev_attr_cap_sync.attr,
+	&dev_attr_cap_brightness.attr,
+	&dev_attr_cap_enable.attr,
+	&dev_attr_cap_speed.attr,
+	&dev_attr_cap_position.attr,
+	&dev_attr_cap_angle.attr,
+	&dev_attr_cap_increment.attr,
+	NULL
+};
+
+/*
+ * Every file of the capabilities group holds the number of indices,
+ * the prefix and the unit of one action type.
+ */
+static struct attribute_group senseact_dev_cap_attr_group = {
+	.name	= "capabilities",
+	.attrs	= senseact_dev_cap_attrs,
+};
+
+#define SENSEACT_DEV_STAT_ATTR_SHOW(name, stat)				\
+static ssize_t senseact_dev_show_stat_##name(struct device *dev,	\
+					     struct device_attribute *attr, \
+					     char *buf)			\
+{									\
+	struct senseact_device *senseact = to_senseact_device(dev);	\
+									\
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", (unsigned long long)	\
+			 atomic64_read(&senseact->stats[stat]));	\
+}									\
+static struct device_attribute dev_attr_stat_##name =			\
+	__ATTR(name, S_IRUGO, senseact_dev_show_stat_##name, NULL)
+
+SENSEACT_DEV_STAT_ATTR_SHOW(actions, SENSEACT_STAT_ACTIONS);
+SENSEACT_DEV_STAT_ATTR_SHOW(frames, SENSEACT_STAT_FRAMES);
+SENSEACT_DEV_STAT_ATTR_SHOW(overruns, SENSEACT_STAT_OVERRUNS);
+SENSEACT_DEV_STAT_ATTR_SHOW(wakeups, SENSEACT_STAT_WAKEUPS);
+SENSEACT_DEV_STAT_ATTR_SHOW(read_bytes, SENSEACT_STAT_READ_BYTES);
+SENSEACT_DEV_STAT_ATTR_SHOW(written, SENSEACT_STAT_WRITTEN);
+SENSEACT_DEV_STAT_ATTR_SHOW(pass_ns, SENSEACT_STAT_PASS_NS);
+
+static struct attribute *senseact_dev_stat_attrs[] = {
+	&dev_attr_stat_actions.attr,
+	&dev_attr_stat_frames.attr,
+	&dev_attr_stat_overruns.attr,
+	&dev_attr_stat_wakeups.attr,
+	&dev_attr_stat_read_bytes.attr,
+	&dev_attr_stat_written.attr,
+	&dev_attr_stat_pass_ns.attr,
+	NULL
+};
+
+/*
+ * Counters of the device, see struct senseact_stats. Actions, frames and
+ * wakeups are counted once for the device, the other counters are summed
+ * up over all open files.
+ */
+static struct attribute_group senseact_dev_stat_attr_group = {
+	.name	= "statistics",
+	.attrs	= senseact_dev_stat_attrs,
+};
+
 static struct attribute_group *senseact_dev_attr_groups[] = {
 	&senseact_dev_attr_group,
+	&senseact_dev_cap_attr_group,
+	&senseact_dev_stat_attr_group,
 	NULL
 };
 
@@ -185,6 +1855,16 @@ static void senseact_dev_release(struct device *dev)
 {
 	struct senseact_device *senseact = to_senseact_device(dev);
 
+	mutex_lock(&senseact_idr_mutex);
+	idr_remove(&senseact_idr, senseact->minor);
+	mutex_unlock(&senseact_idr_mutex);
+
+	/* a device freed without being unregistered may still have commands */
+	cancel_work_sync(&senseact->command_work);
+
+	kfree(senseact->shared);
+	kfree(senseact->acks);
+	kfree(senseact->state);
 	kfree(senseact);
 
 	module_put(THIS_MODULE);
@@ -227,21 +1907,18 @@ EXPORT_SYMBOL_GPL(senseact_class);
 struct senseact_device *senseact_allocate_device(void)
 {
 	struct senseact_device *senseact;
-	unsigned int minor;
+	int minor;
 
 	senseact = kzalloc(sizeof(struct senseact_device), GFP_KERNEL);
 	if (!senseact)
 		return NULL;
 
-	mutex_lock(&senseact_table_mutex);
-	for (minor = 0; minor < SENSEACT_DEVICES; minor++)
-		if (!senseact_table[minor]) {
-			senseact_table[minor] = senseact;
-			break;
-		}
-	mutex_unlock(&senseact_table_mutex);
+	/* reserve the minor, the device is published on registration */
+	mutex_lock(&senseact_idr_mutex);
+	minor = idr_alloc(&senseact_idr, NULL, 0, SENSEACT_MINORS, GFP_KERNEL);
+	mutex_unlock(&senseact_idr_mutex);
 
-	if (minor == SENSEACT_DEVICES) {
+	if (minor < 0) {
 		printk(KERN_ERR "senseact: no more free MINOR numbers\n");
 		goto err_kfree;
 	}
@@ -254,7 +1931,11 @@ struct senseact_device *senseact_allocate_device(void)
 	senseact->dev.class = &senseact_class;
 	device_initialize(&senseact->dev);
 	mutex_init(&senseact->mutex);
+	mutex_init(&senseact->pass_mutex);
+	spin_lock_init(&senseact->command_lock);
+	INIT_WORK(&senseact->command_work, senseact_command_work);
 	spin_lock_init(&senseact->action_lock);
+	seqcount_init(&senseact->state_seq);
 	spin_lock_init(&senseact->queue_lock);
 	INIT_LIST_HEAD(&senseact->queue_list);
 	init_waitqueue_head(&senseact->wait);
@@ -262,6 +1943,7 @@ struct senseact_device *senseact_allocate_device(void)
 	__module_get(THIS_MODULE);
 
 	senseact_set_capabilities(senseact, SENSEACT_TYPE_SYNC, 1);
+	senseact->min_interval = SENSEACT_INTERVAL_MIN;
 
 	return senseact;
 
@@ -293,7 +1975,7 @@ void senseact_free_device(struct senseact_device *senseact)
 EXPORT_SYMBOL(senseact_free_device);
 
 /**
- * senseact_set_capability_array - mark device as capable of certain values
+ * senseact_set_capabilities - mark device as capable of certain values
  * @senseact: device that is capable of emitting or accepting event
  * @type: type of the value
  * @count: number of values
@@ -305,9 +1987,59 @@ void senseact_set_capabilities(struct senseact_device *senseact, unsigned int ty
 			"senseact_set_capability: unknown type %u\n", type);
 	} else {
 		__set_bit(type, senseact->types);
+		senseact->caps[type].count = count;
+	}
+}
+EXPORT_SYMBOL(senseact_set_capabilities);
+
+/**
+ * senseact_set_unit - set prefix and unit of the values of a type
+ * @senseact: device that is capable of emitting or accepting event
+ * @type: type of the value
+ * @prefix: prefix of the values
+ * @unit: unit of the values
+ *
+ * The unit is reported with every action of @type.
+ */
+void senseact_set_unit(struct senseact_device *senseact, unsigned int type, int prefix, unsigned int unit)
+{
+	if (type >= SENSEACT_TYPE_MAX || unit > SENSEACT_UNIT_MAX) {
+		dev_err(&senseact->dev,
+			"senseact_set_unit: unknown type %u or unit %u\n",
+			type, unit);
+	} else {
+		senseact->caps[type].prefix = prefix;
+		senseact->caps[type].unit = unit;
+	}
+}
+EXPORT_SYMBOL(senseact_set_unit);
+
+/*
+ * Allocate room for the latest value of every index of every supported
+ * type but sync. The capabilities are fixed from now on.
+ */
+static int senseact_alloc_state(struct senseact_device *senseact)
+{
+	unsigned int type, count = 0;
+
+	for (type = 0; type <= SENSEACT_TYPE_MAX; type++) {
+		senseact->state_offset[type] = count;
+		if (type != SENSEACT_TYPE_SYNC && is_type_supported(senseact, type))
+			count += senseact->caps[type].count;
 	}
+
+	if (!count)
+		return 0;
+
+	/* the values staged by the current frame follow the published ones */
+	senseact->state = kcalloc(2 * count, sizeof(int), GFP_KERNEL);
+	if (!senseact->state)
+		return -ENOMEM;
+
+	senseact->state_pending = senseact->state + count;
+
+	return 0;
 }
-EXPORT_SYMBOL(senseact_set_capabilities);
 
 /**
  * senseact_register_device - register device with senseact core
@@ -329,10 +2061,26 @@ int senseact_register_device(struct senseact_device *senseact)
 	if (!senseact->name)
 		senseact->name = dev_name(&senseact->dev);
 
+	retval = senseact_alloc_state(senseact);
+	if (retval)
+		return retval;
+
+	if (senseact->pass) {
+		senseact->acks = kzalloc(sizeof(struct senseact_acks),
+					 GFP_KERNEL);
+		if (!senseact->acks)
+			return -ENOMEM;
+	}
+
 	retval = device_add(&senseact->dev);
 	if (retval)
 		return retval;
 
+	mutex_lock(&senseact_idr_mutex);
+	get_device(&senseact->dev);
+	idr_replace(&senseact_idr, senseact, senseact->minor);
+	mutex_unlock(&senseact_idr_mutex);
+
 	path = kobject_get_path(&senseact->dev.kobj, GFP_KERNEL);
 	printk(KERN_INFO "senseact: %s as %s\n",
 		senseact->name, path ? path : "N/A");
@@ -357,6 +2105,10 @@ void senseact_unregister_device(struct senseact_device *senseact)
 	senseact->going_away = 1;
 	mutex_unlock(&senseact->mutex);
 
+	/* asynchronous writers check going_away under the command lock */
+	spin_lock(&senseact->command_lock);
+	spin_unlock(&senseact->command_lock);
+
 	spin_lock(&senseact->queue_lock);
 	list_for_each_entry(queue, &senseact->queue_list, node)
 		kill_fasync(&queue->fasync, SIGIO, POLL_HUP);
@@ -364,9 +2116,18 @@ void senseact_unregister_device(struct senseact_device *senseact)
 
 	wake_up_interruptible(&senseact->wait);
 
-	mutex_lock(&senseact_table_mutex);
-	senseact_table[senseact->minor] = NULL;
-	mutex_unlock(&senseact_table_mutex);
+	/* wait for writes which are still passed to the device */
+	cancel_work_sync(&senseact->command_work);
+	mutex_lock(&senseact->pass_mutex);
+	mutex_unlock(&senseact->pass_mutex);
+
+	mutex_lock(&senseact_idr_mutex);
+	idr_replace(&senseact_idr, NULL, senseact->minor);
+	mutex_unlock(&senseact_idr_mutex);
+
+	/* wait for lookups which may not hold a reference yet */
+	synchronize_rcu();
+	put_device(&senseact->dev);
 
 	if (senseact->users) {
 		if (senseact->flush)
@@ -387,22 +2148,118 @@ EXPORT_SYMBOL(senseact_unregister_device);
  * @values: value of the event
  *
  * This function should be used by drivers implementing various senseact
- * devices.
+ * devices. Values reported from within the pass() method of a write are
+ * acknowledgements of that write rather than part of the sensor stream.
  */
 void senseact_pass_actions(struct senseact_device *senseact,
 			unsigned int type, unsigned int prefix, unsigned int index, unsigned int count, int *values)
 {
 	unsigned long flags;
+	int ack;
 
 	if (is_type_supported(senseact, type)) {
 
+		trace_senseact_pass_actions(senseact, type, index, count);
+
+		ack = !in_interrupt() &&
+		      ACCESS_ONCE(senseact->pass_task) == current;
+
 		spin_lock_irqsave(&senseact->action_lock, flags);
-		senseact_handle_actions(senseact, type, prefix, index, count, values);
+		senseact_handle_actions(senseact, ack, type, prefix, index, count, values);
 		spin_unlock_irqrestore(&senseact->action_lock, flags);
 	}
 }
 EXPORT_SYMBOL(senseact_pass_actions);
 
+/**
+ * senseact_begin_frame() - start a new frame of actions
+ * @senseact: device that is about to report values
+ *
+ * Takes the timestamp and the sequence number for the actions reported
+ * up to the next sync. Drivers call this right before they sample the
+ * hardware; otherwise the frame is stamped by its first action.
+ */
+void senseact_begin_frame(struct senseact_device *senseact)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&senseact->action_lock, flags);
+	senseact_stamp_frame(senseact);
+	spin_unlock_irqrestore(&senseact->action_lock, flags);
+}
+EXPORT_SYMBOL(senseact_begin_frame);
+
+/**
+ * senseact_begin_frame_at() - start a new frame with a given stamp
+ * @senseact: device that is about to report values
+ * @time: monotonic time of the frame
+ * @sequence: sequence number of the frame
+ *
+ * Like senseact_begin_frame(), but lets devices sampled together share
+ * the timestamp and the sequence number of their frames.
+ */
+void senseact_begin_frame_at(struct senseact_device *senseact,
+			     ktime_t time, u32 sequence)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&senseact->action_lock, flags);
+	senseact_stamp_at(senseact->frame_time, time);
+	senseact->sequence = sequence;
+	senseact->frame_open = 1;
+	spin_unlock_irqrestore(&senseact->action_lock, flags);
+}
+EXPORT_SYMBOL(senseact_begin_frame_at);
+
+/**
+ * senseact_abort_frame() - give up the current frame of actions
+ * @senseact: device that failed to complete its frame
+ *
+ * Drivers call this instead of the sync when sampling the hardware
+ * failed. The staged actions of the frame are discarded, actions already
+ * published by queues which do not stage stay where they are, and the
+ * acknowledgements held back by the frame are passed on.
+ */
+void senseact_abort_frame(struct senseact_device *senseact)
+{
+	struct senseact_queue *queue;
+	struct senseact_shared *shared;
+	unsigned long flags;
+	int wake;
+
+	spin_lock_irqsave(&senseact->action_lock, flags);
+
+	if (!senseact->frame_open) {
+		spin_unlock_irqrestore(&senseact->action_lock, flags);
+		return;
+	}
+
+	rcu_read_lock();
+
+	shared = rcu_dereference(senseact->shared);
+	if (shared)
+		shared->next = shared->head;
+
+	list_for_each_entry_rcu(queue, &senseact->queue_list, node)
+		senseact_queue_reset_frame(queue);
+
+	if (senseact->state)
+		memcpy(senseact->state_pending, senseact->state,
+		       (senseact->state_pending - senseact->state) * sizeof(int));
+
+	senseact->frame_open = 0;
+	wake = senseact_release_acks(senseact);
+
+	rcu_read_unlock();
+	spin_unlock_irqrestore(&senseact->action_lock, flags);
+
+	if (wake) {
+		atomic64_inc(&senseact->stats[SENSEACT_STAT_WAKEUPS]);
+		wake_up_interruptible(&senseact->wait);
+	}
+}
+EXPORT_SYMBOL(senseact_abort_frame);
+
 /**
  * file functions
  */
@@ -439,10 +2296,22 @@ static int senseact_release_file(struct inode *inode, struct file *file)
 {
 	struct senseact_queue *queue = file->private_data;
 	struct senseact_device *senseact = queue->senseact;
+	unsigned int interval = queue->interval;
 
 	senseact_detach_queue(senseact, queue);
+	if (queue->flags & SENSEACT_FLAG_SHARED)
+		atomic_dec(&senseact->shared_users);
+	vfree(queue->ring);
+	kfree(queue->prog);
 	kfree(queue);
 
+	/* fall back to the intervals requested by the remaining files */
+	if (interval) {
+		mutex_lock(&senseact->mutex);
+		senseact_update_interval(senseact);
+		mutex_unlock(&senseact->mutex);
+	}
+
 	senseact_close_device(senseact);
 	put_device(&senseact->dev);
 
@@ -453,20 +2322,14 @@ static int senseact_open_file(struct inode *inode, struct file *file)
 {
 	struct senseact_device *senseact;
 	struct senseact_queue *queue;
-	int i = iminor(inode);
+	struct senseact_ring *ring;
 	int retval;
 
-	if (i >= SENSEACT_DEVICES)
-		return -ENODEV;
-
-	retval = mutex_lock_interruptible(&senseact_table_mutex);
-	if (retval)
-		return retval;
-
-	senseact = senseact_table[i];
+	rcu_read_lock();
+	senseact = idr_find(&senseact_idr, iminor(inode));
 	if (senseact)
 		get_device(&senseact->dev);
-	mutex_unlock(&senseact_table_mutex);
+	rcu_read_unlock();
 
 	if (!senseact)
 		return -ENODEV;
@@ -477,7 +2340,19 @@ static int senseact_open_file(struct inode *inode, struct file *file)
 		goto err_put_dev;
 	}
 
-	spin_lock_init(&queue->buffer_lock);
+	ring = senseact_alloc_ring(SENSEACT_BUFFER_SIZE, SENSEACT_FORMAT_ACTION);
+	if (!ring) {
+		retval = -ENOMEM;
+		goto err_kfree_queue;
+	}
+
+	senseact_queue_set_ring(queue, ring, SENSEACT_FORMAT_ACTION, 0);
+	queue->clock = SENSEACT_CLK_MONO;
+	queue->lowat = 1;
+	queue->filter.types = ~0;
+	queue->filter.index_max = 255;
+
+	mutex_init(&queue->read_mutex);
 	queue->senseact = senseact;
 	senseact_attach_queue(senseact, queue);
 
@@ -490,24 +2365,41 @@ static int senseact_open_file(struct inode *inode, struct file *file)
 
  err_free_queue:
 	senseact_detach_queue(senseact, queue);
+	vfree(queue->ring);
+ err_kfree_queue:
 	kfree(queue);
  err_put_dev:
 	put_device(&senseact->dev);
 	return retval;
 }
 
-static ssize_t senseact_write_file(struct file *file, const char __user *buffer,
-			   size_t count, loff_t *ppos)
+/*
+ * Pass written actions to the device. Calls of the pass() method are
+ * serialized by the pass mutex, so they do not hold up open(), flush()
+ * and ioctl() of the device. In asynchronous mode the actions are only
+ * queued for the command worker. Returns the number of actions written.
+ */
+static ssize_t senseact_write_actions(struct senseact_queue *queue,
+				      struct senseact_action *actions,
+				      int *values, unsigned int count)
 {
-	struct senseact_queue *queue = file->private_data;
 	struct senseact_device *senseact = queue->senseact;
-	struct senseact_action action;
-	int retval, offset = 0, value = 0;
+	ktime_t issued = ktime_get();
+	int retval;
 
-	if (!senseact->pass)
-		return -EFAULT;
+	if (senseact->going_away)
+		return -ENODEV;
 
-	retval = mutex_lock_interruptible(&senseact->mutex);
+	if (queue->flags & SENSEACT_FLAG_ASYNC) {
+		retval = senseact_queue_commands(senseact, actions, count);
+		if (retval <= 0)
+			return retval ? retval : -EAGAIN;
+
+		senseact_queue_stat_add(queue, SENSEACT_STAT_WRITTEN, retval);
+		return retval;
+	}
+
+	retval = mutex_lock_interruptible(&senseact->pass_mutex);
 	if (retval)
 		return retval;
 
@@ -516,44 +2408,232 @@ static ssize_t senseact_write_file(struct file *file, const char __user *buffer,
 		goto err_unlock;
 	}
 
-	while (offset < count) {
-		if (copy_from_user(&action, buffer + offset, sizeof(struct senseact_action))) {
-			retval = -EFAULT;
-			goto err_unlock;
-		}
+	retval = senseact_apply(senseact, actions, values, count, issued);
 
-		retval = senseact->pass(senseact, action.type, action.index, 1, &action.value);
-		if (retval)
-			goto err_unlock;
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(),
+					   senseact->ack_time[SENSEACT_CLK_MONO])),
+		     &queue->stats[SENSEACT_STAT_PASS_NS]);
+	if (!retval)
+		senseact_queue_stat_add(queue, SENSEACT_STAT_WRITTEN, count);
+
+ err_unlock:
+	mutex_unlock(&senseact->pass_mutex);
+	return retval ? retval : count;
+}
+
+/*
+ * Allocate room for the actions of a write together with their values.
+ * Writes are limited to SENSEACT_WRITE_MAX actions.
+ */
+static struct senseact_action *senseact_alloc_write(size_t *count, int **values)
+{
+	struct senseact_action *actions;
+	size_t n = min_t(size_t, *count / sizeof(struct senseact_action),
+			 SENSEACT_WRITE_MAX);
+
+	if (!n)
+		return ERR_PTR(-EINVAL);
+
+	actions = kmalloc(n * (sizeof(struct senseact_action) + sizeof(int)),
+			  GFP_KERNEL);
+	if (!actions)
+		return ERR_PTR(-ENOMEM);
+
+	*values = (int *)(actions + n);
+	*count = n;
+
+	return actions;
+}
+
+static ssize_t senseact_write_file(struct file *file, const char __user *buffer,
+			   size_t count, loff_t *ppos)
+{
+	struct senseact_queue *queue = file->private_data;
+	struct senseact_device *senseact = queue->senseact;
+	struct senseact_action *actions;
+	int *values;
+	ssize_t retval;
+
+	if (!senseact->pass)
+		return -EFAULT;
 
-		offset +=  sizeof(struct senseact_action);
+	actions = senseact_alloc_write(&count, &values);
+	if (IS_ERR(actions))
+		return PTR_ERR(actions);
+
+	if (copy_from_user(actions, buffer, count * sizeof(struct senseact_action))) {
+		retval = -EFAULT;
+		goto out;
 	}
 
-	senseact->pass(senseact, SENSEACT_TYPE_SYNC, SENSEACT_SYNC_ACTOR, 1, &value);
+	retval = senseact_write_actions(queue, actions, values, count);
+	if (retval > 0)
+		retval *= sizeof(struct senseact_action);
 
-	retval = offset;
+ out:
+	kfree(actions);
+	return retval;
+}
 
- err_unlock:
-	mutex_unlock(&senseact->mutex);
+/*
+ * writev() hands all segments over at once, so they are passed to the
+ * device under a single lock and completed by a single sync.
+ */
+static ssize_t senseact_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct senseact_queue *queue = iocb->ki_filp->private_data;
+	struct senseact_device *senseact = queue->senseact;
+	struct senseact_action *actions;
+	size_t count = iov_iter_count(from);
+	int *values;
+	ssize_t retval;
+
+	if (!senseact->pass)
+		return -EFAULT;
+
+	actions = senseact_alloc_write(&count, &values);
+	if (IS_ERR(actions))
+		return PTR_ERR(actions);
+
+	if (copy_from_iter(actions, count * sizeof(struct senseact_action), from) !=
+	    count * sizeof(struct senseact_action)) {
+		retval = -EFAULT;
+		goto out;
+	}
+
+	retval = senseact_write_actions(queue, actions, values, count);
+	if (retval > 0)
+		retval *= sizeof(struct senseact_action);
+
+ out:
+	kfree(actions);
 	return retval;
 }
 
-static int senseact_queue_fetch_next_action(struct senseact_queue *queue,
-				  struct senseact_action *action)
+/*
+ * The producer only overwrites actions between tail and head after it
+ * moved the tail, so they can be copied without holding a lock.
+ * Concurrent readers of the same file are serialized by the read mutex.
+ */
+static ssize_t senseact_queue_read(struct senseact_queue *queue,
+				   char __user *buffer, size_t count)
+{
+	struct senseact_ring *ring = queue->ring;
+	size_t size = queue->record_size;
+	unsigned int tail, pos, n, first;
+
+	tail = ACCESS_ONCE(ring->tail);
+	n = min_t(size_t, senseact_queue_count(queue), count / size);
+	if (!n)
+		return 0;
+
+	if (queue->flags & SENSEACT_FLAG_FRAME) {
+		n = senseact_queue_frames(queue, tail, n);
+		if (!n)
+			return -EINVAL;
+	}
+
+	pos = tail & (queue->size - 1);
+	first = min(n, queue->size - pos);
+
+	if (copy_to_user(buffer, queue->buffer + pos * size, first * size))
+		return -EFAULT;
+
+	if (n > first &&
+	    copy_to_user(buffer + first * size, queue->buffer, (n - first) * size))
+		return -EFAULT;
+
+	/*
+	 * Finish reading the actions before the producer may reuse them. If
+	 * the producer dropped actions meanwhile, the copy may be torn and
+	 * has to be repeated.
+	 */
+	smp_mb();
+	if (cmpxchg(&ring->tail, tail, tail + n) != tail)
+		return 0;
+
+	return n * size;
+}
+
+/*
+ * A reader which fell behind the writer of the shared ring skips to its
+ * head and accounts the actions lost as overruns.
+ */
+static void senseact_queue_lapped(struct senseact_queue *queue,
+				  struct senseact_shared *shared)
+{
+	unsigned int head = smp_load_acquire(&shared->head);
+	unsigned int dropped = head - queue->cursor;
+
+	queue->cursor = head;
+	queue->overruns += dropped;
+	queue->ring->overruns = queue->overruns;
+	senseact_queue_stat_add(queue, SENSEACT_STAT_OVERRUNS, dropped);
+}
+
+/*
+ * Copy actions from the shared ring, converted to the format and clock of
+ * the queue and passed through its filter. The copy is checked afterwards
+ * and repeated if the writer overwrote the actions meanwhile.
+ */
+static ssize_t senseact_queue_read_shared(struct senseact_queue *queue,
+					  char __user *buffer, size_t count)
 {
-	int empty;
+	struct senseact_shared *shared = queue->senseact->shared;
+	struct senseact_shared_action *slot;
+	struct senseact_action_ext action;
+	size_t size = queue->record_size, len = 0, frame_len = 0;
+	unsigned int cursor = queue->cursor, head, pos, frame_end;
+	unsigned int first, last;
+
+	head = smp_load_acquire(&shared->head);
+	if (head == cursor)
+		return 0;
+
+	if (head - cursor > SENSEACT_SHARED_SIZE) {
+		senseact_queue_lapped(queue, shared);
+		return 0;
+	}
+
+	frame_end = cursor;
+	memset(&action, 0, sizeof(action));
+
+	for (pos = cursor; pos != head && len + size <= count; pos++) {
+		slot = &shared->actions[pos & (SENSEACT_SHARED_SIZE - 1)];
+
+		memcpy(&action, &slot->action, sizeof(struct senseact_action));
+		action.time = ktime_to_ns(slot->time[queue->clock]);
+		action.sequence = slot->sequence;
 
-	spin_lock_irq(&queue->buffer_lock);
+		if (senseact_queue_subscribed(queue, action.type, action.index,
+					      1, &first, &last)) {
+			if (copy_to_user(buffer + len, &action, size))
+				return -EFAULT;
+			len += size;
+		}
+
+		if (action.type == SENSEACT_TYPE_SYNC) {
+			frame_end = pos + 1;
+			frame_len = len;
+		}
+	}
 
-	empty = queue->head == queue->tail;
-	if (!empty) {
-		*action = queue->buffer[queue->tail++];
-		queue->tail &= SENSEACT_BUFFER_SIZE - 1;
+	/* finish reading the actions before checking the writer */
+	smp_rmb();
+	if (ACCESS_ONCE(shared->next) - cursor > SENSEACT_SHARED_SIZE) {
+		senseact_queue_lapped(queue, shared);
+		return 0;
 	}
 
-	spin_unlock_irq(&queue->buffer_lock);
+	if (queue->flags & SENSEACT_FLAG_FRAME) {
+		if (frame_end == cursor)
+			return -EINVAL;
+		pos = frame_end;
+		len = frame_len;
+	}
 
-	return !empty;
+	queue->cursor = pos;
+	return len;
 }
 
 static ssize_t senseact_read_file(struct file *file, char __user *buffer,
@@ -561,33 +2641,47 @@ static ssize_t senseact_read_file(struct file *file, char __user *buffer,
 {
 	struct senseact_queue *queue = file->private_data;
 	struct senseact_device *senseact = queue->senseact;
-	struct senseact_action action;
-	int retval;
+	ssize_t retval;
 
-	if (count < sizeof(struct senseact_action))
+	if (count < queue->record_size)
 		return -EINVAL;
 
-	if (senseact->going_away)
-		return -ENODEV;
-
-	if (queue->head == queue->tail && (file->f_flags & O_NONBLOCK))
-		return -EAGAIN;
-
-	retval = wait_event_interruptible(senseact->wait,
-		queue->head != queue->tail || senseact->going_away);
-	if (retval)
-		return retval;
+	do {
+		if (senseact->going_away)
+			return -ENODEV;
+
+		/* nonblocking readers take what is there, below the watermark, too */
+		if (file->f_flags & O_NONBLOCK) {
+			if (!senseact_queue_check_avail(queue))
+				return -EAGAIN;
+		} else {
+			retval = wait_event_interruptible(senseact->wait,
+				senseact_queue_check_ready(queue) ||
+				senseact->going_away);
+			if (retval)
+				return retval;
+
+			if (senseact->going_away)
+				return -ENODEV;
+		}
 
-	if (senseact->going_away)
-		return -ENODEV;
+		retval = mutex_lock_interruptible(&queue->read_mutex);
+		if (retval)
+			return retval;
 
-	while (retval + sizeof(struct senseact_action) <= count &&
-	       senseact_queue_fetch_next_action(queue, &action)) {
+		if (queue->flags & SENSEACT_FLAG_SHARED)
+			retval = senseact_queue_read_shared(queue, buffer, count);
+		else
+			retval = senseact_queue_read(queue, buffer, count);
 
-		if (copy_to_user(buffer + retval, &action, sizeof(struct senseact_action)))
-			return -EFAULT;
+		mutex_unlock(&queue->read_mutex);
+	} while (!retval);
 
-		retval += sizeof(struct senseact_action);
+	if (retval > 0) {
+		senseact_queue_stat_add(queue, SENSEACT_STAT_READ_BYTES, retval);
+		if (trace_senseact_read_enabled())
+			trace_senseact_read(senseact, retval / queue->record_size,
+					    senseact_queue_check_avail(queue));
 	}
 
 	return retval;
@@ -599,18 +2693,240 @@ static unsigned int senseact_poll_file(struct file *file, poll_table *wait)
 	struct senseact_device *senseact = queue->senseact;
 
 	poll_wait(file, &senseact->wait, wait);
-	return ((queue->head == queue->tail) ? 0 : (POLLIN | POLLRDNORM)) |
+	return (!senseact_queue_check_ready(queue) ? 0 : (POLLIN | POLLRDNORM)) |
 		(senseact->going_away ? (POLLHUP | POLLERR) : 0);
 }
 
+static void senseact_vm_open(struct vm_area_struct *vma)
+{
+	struct senseact_queue *queue = vma->vm_private_data;
+
+	atomic_inc(&queue->mapped);
+}
+
+static void senseact_vm_close(struct vm_area_struct *vma)
+{
+	struct senseact_queue *queue = vma->vm_private_data;
+
+	atomic_dec(&queue->mapped);
+}
+
+static const struct vm_operations_struct senseact_vm_ops = {
+	.open	= senseact_vm_open,
+	.close	= senseact_vm_close,
+};
+
+static int senseact_mmap_file(struct file *file, struct vm_area_struct *vma)
+{
+	struct senseact_queue *queue = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int retval;
+
+	mutex_lock(&queue->read_mutex);
+
+	if (vma->vm_pgoff || size > senseact_ring_bytes(queue->size, queue->format)) {
+		retval = -EINVAL;
+		goto out;
+	}
+
+	/* the producer must not move the tail of a mapped ring */
+	if (queue->policy != SENSEACT_POLICY_DROP_NEWEST ||
+	    (queue->flags & SENSEACT_FLAG_SHARED)) {
+		retval = -EBUSY;
+		goto out;
+	}
+
+	retval = remap_vmalloc_range(vma, queue->ring, 0);
+	if (retval)
+		goto out;
+
+	vma->vm_private_data = queue;
+	vma->vm_ops = &senseact_vm_ops;
+	senseact_vm_open(vma);
+
+ out:
+	mutex_unlock(&queue->read_mutex);
+	return retval;
+}
+
+/*
+ * Copy the latest values of the selected types to userspace. The values
+ * are gathered consistently with the time and sequence of the last sync.
+ */
+static int senseact_get_state(struct senseact_queue *queue,
+			      struct senseact_state __user *p)
+{
+	struct senseact_device *senseact = queue->senseact;
+	struct senseact_state state;
+	unsigned int type, count, n;
+	unsigned int seq;
+	ktime_t time;
+	u32 sequence;
+	int *values;
+	int retval = 0;
+
+	if (copy_from_user(&state, p, sizeof(struct senseact_state)))
+		return -EFAULT;
+
+	if (!senseact->state)
+		state.types = 0;
+
+	count = 0;
+	for (type = 0; type <= SENSEACT_TYPE_MAX; type++)
+		if (type != SENSEACT_TYPE_SYNC &&
+		    (state.types & SENSEACT_TYPE_BIT(type)) &&
+		    is_type_supported(senseact, type))
+			count += senseact->caps[type].count;
+
+	if (count > state.count)
+		return put_user(count, &p->count) ? -EFAULT : -ENOSPC;
+
+	values = kmalloc(count * sizeof(int), GFP_KERNEL);
+	if (!values)
+		return -ENOMEM;
+
+	do {
+		seq = read_seqcount_begin(&senseact->state_seq);
+
+		n = 0;
+		for (type = 0; type <= SENSEACT_TYPE_MAX; type++) {
+			if (type == SENSEACT_TYPE_SYNC ||
+			    !(state.types & SENSEACT_TYPE_BIT(type)) ||
+			    !is_type_supported(senseact, type))
+				continue;
+
+			memcpy(values + n,
+			       senseact->state + senseact->state_offset[type],
+			       senseact->caps[type].count * sizeof(int));
+			n += senseact->caps[type].count;
+		}
+
+		time = senseact->state_time[queue->clock];
+		sequence = senseact->state_sequence;
+	} while (read_seqcount_retry(&senseact->state_seq, seq));
+
+	state.count = count;
+	state.time = ktime_to_ns(time);
+	state.sequence = sequence;
+
+	if (copy_to_user((void __user *)(unsigned long)state.values, values,
+			 count * sizeof(int)) ||
+	    copy_to_user(p, &state, sizeof(struct senseact_state)))
+		retval = -EFAULT;
+
+	kfree(values);
+	return retval;
+}
+
 static long senseact_do_ioctl(struct file *file, unsigned int cmd,
 			   void __user *p)
 {
+	struct senseact_queue *queue = file->private_data;
 	int __user *ip = (int __user *)p;
+	__u32 __user *up = (__u32 __user *)p;
+	struct senseact_filter filter;
+	struct senseact_capability cap;
+	struct senseact_stats stats;
+	struct senseact_prog prog;
+	__u32 value;
+	int i;
 
 	switch (cmd) {
 	case EVIOCGVERSION:
 		return put_user(EV_VERSION, ip);
+
+	case SENSEACT_IOCGMMAPSIZE:
+		return put_user(senseact_ring_bytes(queue->size, queue->format), up);
+
+	case SENSEACT_IOCGQUEUESIZE:
+		return put_user(queue->size, up);
+
+	case SENSEACT_IOCSQUEUESIZE:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_realloc(queue, value, queue->format);
+
+	case SENSEACT_IOCGOVERRUNS:
+		return put_user(ACCESS_ONCE(queue->overruns), up);
+
+	case SENSEACT_IOCGPOLICY:
+		return put_user(queue->policy, up);
+
+	case SENSEACT_IOCSPOLICY:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_set_policy(queue, value);
+
+	case SENSEACT_IOCGFORMAT:
+		return put_user(queue->format, up);
+
+	case SENSEACT_IOCSFORMAT:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_realloc(queue, queue->size, value);
+
+	case SENSEACT_IOCGFLAGS:
+		return put_user(queue->flags, up);
+
+	case SENSEACT_IOCSFLAGS:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_set_flags(queue, value);
+
+	case SENSEACT_IOCGFILTER:
+		if (copy_to_user(p, &queue->filter, sizeof(struct senseact_filter)))
+			return -EFAULT;
+		return 0;
+
+	case SENSEACT_IOCSFILTER:
+		if (copy_from_user(&filter, p, sizeof(struct senseact_filter)))
+			return -EFAULT;
+		return senseact_queue_set_filter(queue, &filter);
+
+	case SENSEACT_IOCGCAPABILITY:
+		if (copy_from_user(&cap, p, sizeof(struct senseact_capability)))
+			return -EFAULT;
+		if (cap.type > SENSEACT_TYPE_MAX)
+			return -EINVAL;
+		senseact_get_capability(queue->senseact, cap.type, &cap);
+		if (copy_to_user(p, &cap, sizeof(struct senseact_capability)))
+			return -EFAULT;
+		return 0;
+
+	case SENSEACT_IOCGLOWAT:
+		return put_user(queue->lowat, up);
+
+	case SENSEACT_IOCSLOWAT:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_set_lowat(queue, value);
+
+	case SENSEACT_IOCGSTATS:
+		senseact_get_stats(queue->stats, &stats);
+		if (copy_to_user(p, &stats, sizeof(struct senseact_stats)))
+			return -EFAULT;
+		return 0;
+
+	case SENSEACT_IOCGSTATE:
+		return senseact_get_state(queue, p);
+
+	case SENSEACT_IOCGINTERVAL:
+		return put_user(queue->interval, up);
+
+	case SENSEACT_IOCSINTERVAL:
+		if (get_user(value, up))
+			return -EFAULT;
+		return senseact_queue_set_interval(queue, value);
+
+	case SENSEACT_IOCSPROG:
+		if (copy_from_user(&prog, p, sizeof(struct senseact_prog)))
+			return -EFAULT;
+		return senseact_queue_set_prog(queue, &prog);
+
+	case SENSEACT_IOCSCLOCKID:
+		if (get_user(i, ip))
+			return -EFAULT;
+		return senseact_queue_set_clock(queue, i);
 	}
 
 	return -EINVAL;
@@ -643,7 +2959,9 @@ static const struct file_operations senseact_fops = {
 	.owner		= THIS_MODULE,
 	.read		= senseact_read_file,
 	.write		= senseact_write_file,
+	.write_iter	= senseact_write_iter,
 	.poll		= senseact_poll_file,
+	.mmap		= senseact_mmap_file,
 	.open		= senseact_open_file,
 	.release	= senseact_release_file,
 	.unlocked_ioctl	= senseact_ioctl_file,
@@ -661,24 +2979,39 @@ static int __init senseact_init(void)
 		return retval;
 	}
 
-	retval = register_chrdev(SENSEACT_MAJOR, "senseact", &senseact_fops);
+	retval = register_chrdev_region(MKDEV(SENSEACT_MAJOR, 0),
+					SENSEACT_MINORS, "senseact");
 	if (retval) {
 		printk(KERN_ERR "senseact: unable to register char major %d", SENSEACT_MAJOR);
 		goto fail1;
 	}
 
+	cdev_init(&senseact_cdev, &senseact_fops);
+	senseact_cdev.owner = THIS_MODULE;
+
+	retval = cdev_add(&senseact_cdev, MKDEV(SENSEACT_MAJOR, 0),
+			  SENSEACT_MINORS);
+	if (retval) {
+		printk(KERN_ERR "senseact: unable to add char device\n");
+		goto fail2;
+	}
+
 	return 0;
 
+ fail2:
+	unregister_chrdev_region(MKDEV(SENSEACT_MAJOR, 0), SENSEACT_MINORS);
  fail1:
-	class_unregister(&input_class);
+	class_unregister(&senseact_class);
 	return retval;
 }
 subsys_initcall(senseact_init);
 
 static void __exit senseact_exit(void)
 {
-	unregister_chrdev(SENSEACT_MAJOR, "senseact");
+	cdev_del(&senseact_cdev);
+	unregister_chrdev_region(MKDEV(SENSEACT_MAJOR, 0), SENSEACT_MINORS);
 	class_unregister(&senseact_class);
+	idr_destroy(&senseact_idr);
 }
 module_exit(senseact_exit);
 
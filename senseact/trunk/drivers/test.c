@@ -15,11 +15,22 @@
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/platform_device.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
 #include <linux/senseact-poll.h>
 
+/* number of increments in a benchmark frame */
+#define TEST_BENCH_WIDTH	16
+
 struct test_device {
 	struct senseact_poll_device *senseact_poll;
 	int values[2];
+
+	struct mutex bench_mutex;
+	int bench[TEST_BENCH_WIDTH];
+	unsigned long bench_frames;
+	u64 bench_ns;
 };
 
 /*
@@ -33,9 +44,6 @@ static int test_poll(struct senseact_poll_device *senseact_poll)
 	test->values[0]++;
 	test->values[1]--;
 
-	printk("senseact_poll POSITION %i - %i\n", test->values[0], test->values[1]);
-
-
 	senseact_pass_actions(senseact, SENSEACT_TYPE_POSITION, SENSEACT_PREFIX_NONE, 0, 2, test->values);
 	senseact_sync(senseact, SENSEACT_SYNC_SENSOR);
 
@@ -51,17 +59,11 @@ static int test_pass(struct senseact_device *senseact, unsigned int type, unsign
 		switch (type) {
 		case SENSEACT_TYPE_POSITION:
 			n = index + i;
-			if (n < 2) {
-				printk("senseact_pass POSITION %i <- %i\n", n, values[i]);
+			if (n < 2)
 				test->values[n] = values[i];
-			} else {
-				printk("senseact_pass POSITION overrun %i\n", n);
-			}
 			break;
 
 		case SENSEACT_TYPE_SYNC:
-			printk("senseact_pass SYNC\n");
-
 			senseact_pass_actions(senseact, SENSEACT_TYPE_POSITION, SENSEACT_PREFIX_NONE, 0, 2, test->values);
 			senseact_sync(senseact, SENSEACT_SYNC_ACTOR);
 
@@ -72,6 +74,90 @@ static int test_pass(struct senseact_device *senseact, unsigned int type, unsign
 	return 0;
 }
 
+/*
+ * Benchmark of the senseact core: writing N to the benchmark attribute
+ * passes N frames of TEST_BENCH_WIDTH increments and a sync to the files
+ * which have the device open, reading it reports the last run. Polling
+ * is stopped meanwhile, so its frames do not interleave with the ones of
+ * the benchmark.
+ */
+static ssize_t test_bench_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct test_device *test = dev_get_drvdata(dev);
+	u64 actions, rate = 0, cost = 0;
+	ssize_t len;
+
+	mutex_lock(&test->bench_mutex);
+
+	actions = (u64)test->bench_frames * (TEST_BENCH_WIDTH + 1);
+	if (test->bench_ns) {
+		rate = actions * NSEC_PER_SEC;
+		do_div(rate, test->bench_ns);
+	}
+	if (actions) {
+		cost = test->bench_ns;
+		do_div(cost, actions);
+	}
+
+	len = scnprintf(buf, PAGE_SIZE,
+			"%lu frames %llu actions %llu ns %llu actions/s %llu ns/action\n",
+			test->bench_frames, (unsigned long long)actions,
+			(unsigned long long)test->bench_ns,
+			(unsigned long long)rate, (unsigned long long)cost);
+
+	mutex_unlock(&test->bench_mutex);
+	return len;
+}
+
+static ssize_t test_bench_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct test_device *test = dev_get_drvdata(dev);
+	struct senseact_device *senseact = test->senseact_poll->senseact;
+	unsigned long frames, i;
+	ktime_t start;
+	u64 ns = 0;
+	int j;
+
+	if (kstrtoul(buf, 0, &frames))
+		return -EINVAL;
+
+	mutex_lock(&test->bench_mutex);
+
+	/* the device mutex keeps files from restarting the poll */
+	mutex_lock(&senseact->mutex);
+	if (senseact->users)
+		senseact->close(senseact);
+
+	for (i = 0; i < frames; i++) {
+		for (j = 0; j < TEST_BENCH_WIDTH; j++)
+			test->bench[j]++;
+
+		start = ktime_get();
+		senseact_pass_actions(senseact, SENSEACT_TYPE_INCREMENT,
+				      SENSEACT_PREFIX_NONE, 0, TEST_BENCH_WIDTH,
+				      test->bench);
+		senseact_sync(senseact, SENSEACT_SYNC_SENSOR);
+		ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		cond_resched();
+	}
+
+	if (senseact->users)
+		senseact->open(senseact);
+	mutex_unlock(&senseact->mutex);
+
+	test->bench_frames = frames;
+	test->bench_ns = ns;
+
+	mutex_unlock(&test->bench_mutex);
+	return count;
+}
+
+static DEVICE_ATTR(benchmark, S_IRUGO | S_IWUSR, test_bench_show, test_bench_store);
+
 static int __devinit test_probe(struct platform_device *dev)
 {
 	struct test_device *test;
@@ -86,6 +172,8 @@ static int __devinit test_probe(struct platform_device *dev)
 		goto exit;
 	}
 
+	mutex_init(&test->bench_mutex);
+
 	senseact_poll = senseact_allocate_poll_device();
 	if (!senseact_poll) {
 		dev_err(&dev->dev, "not enough memory for senseact poll device\n");
@@ -108,6 +196,7 @@ static int __devinit test_probe(struct platform_device *dev)
 	senseact_set_drvdata(senseact, test);
 
 	senseact_set_capabilities(senseact, SENSEACT_TYPE_POSITION, 2);
+	senseact_set_capabilities(senseact, SENSEACT_TYPE_INCREMENT, TEST_BENCH_WIDTH);
 
 	rc = senseact_register_poll_device(senseact_poll);
 	if (rc) {
@@ -117,8 +206,17 @@ static int __devinit test_probe(struct platform_device *dev)
 
 	platform_set_drvdata(dev, test);
 
+	rc = device_create_file(&dev->dev, &dev_attr_benchmark);
+	if (rc) {
+		dev_err(&dev->dev, "could not create benchmark attribute\n");
+		goto exit_unregister_poll;
+	}
+
 	return 0;
 
+exit_unregister_poll:
+	platform_set_drvdata(dev, NULL);
+	senseact_unregister_poll_device(senseact_poll);
 exit_free_poll:
 	senseact_free_poll_device(senseact_poll);
 exit_kfree:
@@ -132,6 +230,7 @@ static int __devexit test_remove(struct platform_device *dev)
 	struct test_device *test = platform_get_drvdata(dev);
 	struct senseact_poll_device *senseact_poll = test->senseact_poll;
 
+	device_remove_file(&dev->dev, &dev_attr_benchmark);
 	senseact_unregister_poll_device(senseact_poll);
 	platform_set_drvdata(dev, NULL);
 	senseact_free_poll_device(senseact_poll);
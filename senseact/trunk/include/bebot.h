@@ -66,6 +66,7 @@ static inline int bebot_init(struct bebot *bebot)
 {
 	char *name[] = { "/dev/senseact/base", "/dev/senseact/ir",
 			 "/dev/senseact/ir0", "/dev/senseact/ir1" };
+	__u32 flags = SENSEACT_FLAG_FRAME;
 	int fds = 0, fd, i;
 
 	memset(bebot, 0, sizeof(struct bebot));
@@ -73,6 +74,9 @@ static inline int bebot_init(struct bebot *bebot)
 	for (i = 0; i < sizeof(name) / sizeof(*name); i++) {
 		fd = open(name[i], O_RDWR | O_NONBLOCK);
 		if (fd != -1) {
+			/* only read complete frames */
+			ioctl(fd, SENSEACT_IOCSFLAGS, &flags);
+
 			if (bebot->fds < BEBOT_FD_COUNT) {
 				fds += 1 << i;
 				bebot->fd[bebot->fds] = fd;
@@ -11,14 +11,55 @@
 
 #include "senseact.h"
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+
+/*
+ * Number of buckets of the poll histograms. Bucket n counts the times
+ * below 2^n microseconds not counted by a lower bucket, the last one all
+ * longer times.
+ */
+#define SENSEACT_POLL_HIST	24
+
+struct senseact_poll_group;
 
 /**
  * struct senseact_polled_dev - simple polled senseact device
  * @poll: driver-supplied method that polls the device and posts
- *	senseact events (mandatory).
+ *	senseact events (mandatory). Returns a negative error code, 0
+ *	or, in adaptive mode, a positive value if the device is active,
+ *	e.g. its values changed beyond a threshold or an actor is moving.
  * @poll_interval: specifies how often the poll() method shoudl be called.
+ *	Set by the driver as the default, adjusted at runtime to the
+ *	intervals requested by the open files or through sysfs.
+ * @default_interval: interval used while no file requests one
+ * @requested: shortest interval requested by the open files, 0 if none
+ * @override: interval set through sysfs, overrides the requested one
+ * @min_interval: shortest interval the device supports, which bounds
+ *	the intervals requested by the open files and the adaptive mode.
+ *	0 keeps the default of the senseact core, or 1 ms in precise mode.
+ * @max_interval: longest interval of the adaptive mode, which is enabled
+ *	by setting it. The interval shrinks towards @min_interval while the
+ *	device is active and grows towards @max_interval while it is idle.
+ * @adaptive: current interval of the adaptive mode
+ * @precise: poll at a fixed rate driven by a high resolution timer
+ *	instead of waiting @poll_interval after every poll.
  * @senseact: senseact device structure associated with the poll device.
  *	Must be properly initialized by the driver.
+ * @wq: workqueue of the device running its polls
+ * @timer: starts the polls in precise mode
+ * @tick: runs a poll in precise mode
+ * @group_id: sampling group of the device, 0 for none. Devices of a group
+ *	are polled back to back and share timestamp and sequence number.
+ * @group: sampling group the device is a member of
+ * @group_node: entry in the member list of @group
+ * @group_active: set while the device is polled by @group
+ * @last: start of the previous poll
+ * @polls: number of calls of the poll() method
+ * @errors: number of failed calls of the poll() method
+ * @missed: number of polls skipped in precise mode as the previous one
+ *	was still running
+ * @period: histogram of the time between the starts of two polls
+ * @duration: histogram of the time spent in the poll() method
  *
  * Polled senseact device provides a skeleton for supporting simple senseact
  * devices that do not raise interrupts but have to be periodically
@@ -27,9 +68,31 @@
 struct senseact_poll_device {
 	int (*poll)(struct senseact_poll_device *dev);
 	unsigned int poll_interval; /* msec */
+	unsigned int default_interval;
+	unsigned int requested;
+	unsigned int override;
+	unsigned int min_interval;
+	unsigned int max_interval;
+	unsigned int adaptive;
+	int precise;
 
 	struct senseact_device *senseact;
+	struct workqueue_struct *wq;
 	struct delayed_work work;
+	struct hrtimer timer;
+	struct work_struct tick;
+
+	unsigned int group_id;
+	struct senseact_poll_group *group;
+	struct list_head group_node;
+	int group_active;
+
+	ktime_t last;
+	unsigned long polls;
+	unsigned long errors;
+	unsigned long missed;
+	unsigned long period[SENSEACT_POLL_HIST];
+	unsigned long duration[SENSEACT_POLL_HIST];
 };
 
 struct senseact_poll_device *senseact_allocate_poll_device(void);
@@ -37,6 +37,43 @@ struct senseact_action {
 
 #define senseact_action_size(void) sizeof(struct senseact_action)
 
+/*
+ * The extended action structure
+ *
+ * Starts with the fields of struct senseact_action and adds the time of
+ * the frame in nanoseconds of the clock selected by SENSEACT_IOCSCLOCKID
+ * and the sequence number of the frame. All actions up to and including
+ * a sync share time and sequence. @flags marks acknowledgements.
+ */
+struct senseact_action_ext {
+	__u8 type;
+	__s8 prefix;
+	__u8 unit;
+	__u8 index;
+	__s32 value;
+	__u64 time;
+	__u32 sequence;
+	__u32 flags;
+};
+
+/*
+ * Action flags
+ *
+ * ACK marks the actions a device reports while it applies written
+ * actions. They form frames of their own, which are terminated by an
+ * actor sync whose value is the time in microseconds from the write()
+ * to the completion. Their time is the one the device started to apply
+ * the write, their sequence counts the applied writes.
+ */
+#define SENSEACT_ACTION_FLAG_ACK	0x00000001
+
+/*
+ * Record formats
+ */
+#define SENSEACT_FORMAT_ACTION		0	/* struct senseact_action */
+#define SENSEACT_FORMAT_EXT		1	/* struct senseact_action_ext */
+#define SENSEACT_FORMAT_MAX		1
+
 /*
  * Action types
  */
@@ -50,6 +87,8 @@ struct senseact_action {
 #define SENSEACT_TYPE_MAX		0x07
 #define SENSEACT_TYPE_CNT		(SENSEACT_TYPE_MAX + 1)
 
+#define SENSEACT_TYPE_BIT(type)		(1 << (type))
+
 /*
  * Action prefix
  */
@@ -70,6 +109,18 @@ struct senseact_action {
 #define SENSEACT_PREFIX_ZEPTO		-7
 #define SENSEACT_PREFIX_YOCTO		-8
 
+/*
+ * Action units
+ */
+#define SENSEACT_UNIT_NONE		0x00
+#define SENSEACT_UNIT_METER		0x01
+#define SENSEACT_UNIT_RADIAN		0x02
+#define SENSEACT_UNIT_METER_PER_SECOND	0x03
+#define SENSEACT_UNIT_RADIAN_PER_SECOND	0x04
+#define SENSEACT_UNIT_SECOND		0x05
+#define SENSEACT_UNIT_VOLT		0x06
+#define SENSEACT_UNIT_MAX		0x06
+
 /*
  * Sync subtypes
  */
@@ -77,14 +128,336 @@ struct senseact_action {
 #define SENSEACT_SYNC_ACTOR		2
 
 /*
- * In-kernel definitions.
+ * Shared ring buffer
+ *
+ * Every open file owns a ring of actions which can be mapped into the
+ * address space of the reader with mmap(). The mapping starts with the
+ * ring header, the records of @record_size bytes follow at @offset. The
+ * record format is selected by SENSEACT_IOCSFORMAT. The kernel advances @head
+ * after it has stored an action, the reader advances @tail after it has
+ * consumed actions. Both indices run freely and have to be masked with
+ * (@size - 1) to get the position inside the ring. A mapped ring should
+ * either be consumed through the mapping or through read(), not both.
+ * @overruns counts the actions dropped because the ring was full.
+ * Only rings with the SENSEACT_POLICY_DROP_NEWEST policy can be mapped,
+ * as all other policies let the kernel move the tail.
  */
-#ifdef __KERNEL__
+struct senseact_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 size;
+	__u32 offset;
+	__u32 overruns;
+	__u32 record_size;
+	__u32 reserved[2];
+};
+
+/*
+ * Overflow policies
+ *
+ * DROP_NEWEST drops frames which do not fit into the ring anymore,
+ * DROP_OLDEST drops the oldest complete frames to make room and LATEST
+ * only keeps the latest value of every type and index together with the
+ * last sync.
+ */
+#define SENSEACT_POLICY_DROP_NEWEST	0
+#define SENSEACT_POLICY_DROP_OLDEST	1
+#define SENSEACT_POLICY_LATEST		2
+#define SENSEACT_POLICY_MAX		2
+
+/*
+ * Queue flags
+ *
+ * FRAME makes read() return complete frames only, i.e. runs of actions
+ * terminated by a sync. A read() whose buffer cannot hold the next frame
+ * fails with EINVAL. poll() reports a queue as readable once a complete
+ * frame is available. As frames are delimited by their syncs, FRAME
+ * cannot be combined with a filter which drops syncs (EINVAL).
+ *
+ * By default readers are woken up and SIGIO is sent once per frame when
+ * its sync arrives. EAGER does this for every batch of actions instead.
+ *
+ * SHARED makes read() take the actions from a ring shared by all files of
+ * the device in this mode, so every action is stored once regardless of
+ * the number of readers. The shared ring only publishes complete frames
+ * and never waits for a reader; the actions a reader falls behind on are
+ * counted as overruns. Shared files cannot be mapped, their queue size
+ * and policy have no effect.
+ *
+ * ASYNC makes write() return as soon as the actions are queued for the
+ * device. A queued action is replaced by a later one of the same type
+ * and index until it is applied. write() fails with EAGAIN if none of
+ * the actions could be queued. The device reports the applied actions
+ * followed by an actor sync through the read stream.
+ */
+#define SENSEACT_FLAG_FRAME		0x0001
+#define SENSEACT_FLAG_EAGER		0x0002
+#define SENSEACT_FLAG_SHARED		0x0004
+#define SENSEACT_FLAG_ASYNC		0x0008
+#define SENSEACT_FLAG_MASK		0x000f
+
+/*
+ * Subscription filter
+ *
+ * A queue only receives actions whose type is set in @types and whose
+ * index lies within @index_min and @index_max. Syncs are only subject to
+ * @types. @flags selects between the sensor stream and acknowledgements,
+ * see SENSEACT_ACTION_FLAG_ACK. By default all actions are received.
+ */
+struct senseact_filter {
+	__u32 types;
+	__u8 index_min;
+	__u8 index_max;
+	__u16 flags;
+};
+
+#define SENSEACT_FILTER_NO_ACK		0x0001	/* drop acknowledgements */
+#define SENSEACT_FILTER_ACK_ONLY	0x0002	/* only receive acknowledgements */
+#define SENSEACT_FILTER_MASK		0x0003
+
+/*
+ * Capability of a device for one action type
+ *
+ * @count is the number of indices the device uses for @type, @prefix and
+ * @unit are the ones of its values. Types not supported by the device
+ * have a @count of zero.
+ */
+struct senseact_capability {
+	__u8 type;
+	__s8 prefix;
+	__u8 unit;
+	__u8 reserved;
+	__u32 count;
+};
+
+/*
+ * Statistics
+ *
+ * Counters of an open file, or of the device as a whole. @actions and
+ * @frames count the actions and syncs received, @overruns the actions
+ * dropped, @wakeups the times readers were woken up, @read_bytes the
+ * bytes read. @written counts the actions written to the device and
+ * @pass_ns the time the device spent carrying them out. Asynchronous
+ * writes are applied by a worker on behalf of all files, so their time
+ * only counts for the device, not for the file which wrote them.
+ */
+struct senseact_stats {
+	__u64 actions;
+	__u64 frames;
+	__u64 overruns;
+	__u64 wakeups;
+	__u64 read_bytes;
+	__u64 written;
+	__u64 pass_ns;
+};
+
+/*
+ * State snapshot
+ *
+ * The latest value of every index of the types set in @types, ordered by
+ * type and index, together with the time and sequence number of the last
+ * sync. The time is the one of the clock selected by SENSEACT_IOCSCLOCKID.
+ * @values points to room for @count values. On return @count holds the
+ * number of values of the selected types, the call fails with ENOSPC if
+ * they do not fit.
+ */
+struct senseact_state {
+	__u32 types;
+	__u32 count;
+	__u64 values;
+	__u64 time;
+	__u32 sequence;
+	__u32 reserved;
+};
+
+/*
+ * Frame programs
+ *
+ * A program attached to a file runs on every complete frame of its queue
+ * before the frame becomes visible to the reader. It can rewrite and
+ * delete actions of the frame and decides whether the frame is kept. A
+ * file with a program only receives complete frames; files in shared
+ * mode do not run programs.
+ *
+ * The program works on the accumulator A and SENSEACT_PROG_MEM words of
+ * scratch memory M[], which keep their values from frame to frame. The
+ * action of a frame an instruction refers to is selected by @type and
+ * @index, syncs are not accessible.
+ *
+ *   LD      A = value of the action, or @k if the frame does not have it
+ *   LDK     A = @k
+ *   LDM     A = M[@k]
+ *   STM     M[@k] = A
+ *   ST      value of the action = A
+ *   DEL     delete the action from the frame
+ *   MAX     A = largest value of @type in the frame, or @k if none
+ *   MIN     A = smallest value of @type in the frame, or @k if none
+ *   ADD     A += @k
+ *   SUB     A -= @k
+ *   MUL     A *= @k
+ *   DIV     A /= @k, @k > 0
+ *   MOD     A %= @k, @k > 0
+ *   ADDM    A += M[@k]
+ *   SUBM    A -= M[@k]
+ *   ABS     A = |A|
+ *   JA      skip @k instructions
+ *   JEQ     skip @jt instructions if A == @k, @jf otherwise
+ *   JGT     skip @jt instructions if A > @k, @jf otherwise
+ *   JGE     skip @jt instructions if A >= @k, @jf otherwise
+ *   RET     keep the frame if @k is not zero, drop it otherwise
+ *
+ * Jumps only go forward and the last instruction has to be a RET, so
+ * every program terminates. Programs are checked when they are attached;
+ * reserved fields have to be zero.
+ *
+ * Classic BPF does not fit here: its programs cannot write to the data
+ * they inspect, so they can neither rewrite nor delete actions, and its
+ * scratch memory does not survive from one run to the next, which
+ * filters comparing a frame with the previous ones rely on.
+ */
+enum {
+	SENSEACT_OP_LD,
+	SENSEACT_OP_LDK,
+	SENSEACT_OP_LDM,
+	SENSEACT_OP_STM,
+	SENSEACT_OP_ST,
+	SENSEACT_OP_DEL,
+	SENSEACT_OP_MAX,
+	SENSEACT_OP_MIN,
+	SENSEACT_OP_ADD,
+	SENSEACT_OP_SUB,
+	SENSEACT_OP_MUL,
+	SENSEACT_OP_DIV,
+	SENSEACT_OP_MOD,
+	SENSEACT_OP_ADDM,
+	SENSEACT_OP_SUBM,
+	SENSEACT_OP_ABS,
+	SENSEACT_OP_JA,
+	SENSEACT_OP_JEQ,
+	SENSEACT_OP_JGT,
+	SENSEACT_OP_JGE,
+	SENSEACT_OP_RET,
+	SENSEACT_OP_CNT
+};
+
+#define SENSEACT_PROG_MAX	64	/* maximum number of instructions */
+#define SENSEACT_PROG_MEM	16	/* number of scratch memory words */
+
+struct senseact_insn {
+	__u16 code;
+	__u8 jt;
+	__u8 jf;
+	__u8 type;
+	__u8 index;
+	__u16 reserved;
+	__s32 k;
+};
+
+/*
+ * @insns points to @len instructions. A @len of zero detaches the
+ * program of the file.
+ */
+struct senseact_prog {
+	__u32 len;
+	__u32 reserved;
+	__u64 insns;
+};
+
+/*
+ * IOCTLs
+ */
+#define SENSEACT_IOCGMMAPSIZE		_IOR('S', 0x01, __u32)	/* get size of the ring mapping */
+#define SENSEACT_IOCGQUEUESIZE		_IOR('S', 0x02, __u32)	/* get number of actions in the ring */
+#define SENSEACT_IOCSQUEUESIZE		_IOW('S', 0x03, __u32)	/* set number of actions in the ring (power of 2) */
+#define SENSEACT_IOCGOVERRUNS		_IOR('S', 0x04, __u32)	/* get number of dropped actions */
+#define SENSEACT_IOCGPOLICY		_IOR('S', 0x05, __u32)	/* get overflow policy */
+#define SENSEACT_IOCSPOLICY		_IOW('S', 0x06, __u32)	/* set overflow policy */
+#define SENSEACT_IOCGFORMAT		_IOR('S', 0x07, __u32)	/* get record format */
+#define SENSEACT_IOCSFORMAT		_IOW('S', 0x08, __u32)	/* set record format */
+#define SENSEACT_IOCSCLOCKID		_IOW('S', 0x09, int)	/* set clock of the time stamps */
+#define SENSEACT_IOCGFLAGS		_IOR('S', 0x0a, __u32)	/* get queue flags */
+#define SENSEACT_IOCSFLAGS		_IOW('S', 0x0b, __u32)	/* set queue flags */
+#define SENSEACT_IOCGFILTER		_IOR('S', 0x0c, struct senseact_filter)	/* get subscription filter */
+#define SENSEACT_IOCSFILTER		_IOW('S', 0x0d, struct senseact_filter)	/* set subscription filter */
+#define SENSEACT_IOCGCAPABILITY		_IOWR('S', 0x0e, struct senseact_capability)	/* get capability of a type */
+#define SENSEACT_IOCGLOWAT		_IOR('S', 0x0f, __u32)	/* get minimum number of actions for readiness */
+#define SENSEACT_IOCSLOWAT		_IOW('S', 0x10, __u32)	/* set minimum number of actions for readiness */
+#define SENSEACT_IOCGSTATS		_IOR('S', 0x11, struct senseact_stats)	/* get statistics of the file */
+#define SENSEACT_IOCGSTATE		_IOWR('S', 0x12, struct senseact_state)	/* get latest values of the device */
+#define SENSEACT_IOCSPROG		_IOW('S', 0x13, struct senseact_prog)	/* attach frame program */
+#define SENSEACT_IOCGINTERVAL		_IOR('S', 0x14, __u32)	/* get requested sample interval in ms */
+#define SENSEACT_IOCSINTERVAL		_IOW('S', 0x15, __u32)	/* request sample interval in ms, 0 for none */
+
+/*
+ * Userspace helpers for the shared ring buffer.
+ */
+#ifndef __KERNEL__
+
+static inline char *senseact_ring_records(struct senseact_ring *ring)
+{
+	return (char *)ring + ring->offset;
+}
+
+static inline unsigned int senseact_ring_count(struct senseact_ring *ring)
+{
+	unsigned int count = *(volatile __u32 *)&ring->head - ring->tail;
 
+	__sync_synchronize();
+	return count;
+}
+
+static inline struct senseact_action *senseact_ring_peek(struct senseact_ring *ring, unsigned int n)
+{
+	return (struct senseact_action *)(senseact_ring_records(ring) +
+		((ring->tail + n) & (ring->size - 1)) * ring->record_size);
+}
+
+static inline struct senseact_action_ext *senseact_ring_peek_ext(struct senseact_ring *ring, unsigned int n)
+{
+	return (struct senseact_action_ext *)senseact_ring_peek(ring, n);
+}
+
+static inline void senseact_ring_consume(struct senseact_ring *ring, unsigned int n)
+{
+	__sync_synchronize();
+	ring->tail += n;
+}
+
+#else
+
+/*
+ * In-kernel definitions.
+ */
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
 #include <linux/mod_devicetable.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+
+#define SENSEACT_COMMAND_MAX	64
+
+struct senseact_shared;
+struct senseact_acks;
+
+enum {
+	SENSEACT_STAT_ACTIONS,
+	SENSEACT_STAT_FRAMES,
+	SENSEACT_STAT_OVERRUNS,
+	SENSEACT_STAT_WAKEUPS,
+	SENSEACT_STAT_READ_BYTES,
+	SENSEACT_STAT_WRITTEN,
+	SENSEACT_STAT_PASS_NS,
+	SENSEACT_STAT_MAX
+};
+
+enum {
+	SENSEACT_CLK_MONO,
+	SENSEACT_CLK_REAL,
+	SENSEACT_CLK_BOOT,
+	SENSEACT_CLK_MAX
+};
 
 /**
  * struct senseact_dev - represents an input device
@@ -92,6 +465,7 @@ struct senseact_action {
  * @addr: physical address of the device
  * @private: private driver data
  * @types: bit mask for supported types
+ * @caps: number of indices, prefix and unit of every type
  * @open: this method is called when the very first user calls
  *	senseact_open_device(). The driver must prepare the device
  *	to start generating actions (start polling thread,
@@ -102,8 +476,16 @@ struct senseact_action {
  *	values loaded into the device when disconnecting from it
  * @pass: action handler for actions sent _to_ the device, like.
  *      The device is expected to carry out the requested
- *	action. The call is protected by @action_lock and must not sleep ????
- * @mutex: serializes calls to open(), close() and flush() methods
+ *	action. Calls are serialized by @pass_mutex and may sleep.
+ * @set_interval: called when the shortest sample interval requested by
+ *	the open files changes, 0 if none requests one. Devices without it
+ *	do not support SENSEACT_IOCSINTERVAL. Called with @mutex held.
+ * @min_interval: shortest sample interval in ms the device supports,
+ *	shorter requests are raised to it. Defaults to 10 ms, poll devices
+ *	set it from their own @min_interval.
+ * @mutex: serializes calls to open(), close(), flush() and set_interval()
+ *	methods
+ * @pass_mutex: serializes calls to the pass() method for written actions
  * @users: stores number of users that opened this device.
  *      It is used by senseact_open_device() and senseact_close_device()
  *	to make sure that dev->open() is only called when the first
@@ -112,11 +494,35 @@ struct senseact_action {
  * @going_away: marks devices that are in a middle of unregistering and
  *	causes senseact_open_device*() fail with -ENODEV.
  * @action_lock: this spinlock is is taken when senseact core receives
- *	and processes a new actions for the device.
+ *	and processes a new actions for the device and when the queues of
+ *	the device are reconfigured.
  * @queue_list: list of senseact handles associated with the device. When
  *	accessing the list dev->queue_lock must be held
  * @queue_lock: this spinlock is is taken when senseact core receives
  *	and processes a new action for the user.
+ * @frame_time: time of the current frame for every supported clock
+ * @sequence: sequence number of the current frame
+ * @frame_open: set between the first action of a frame and its sync
+ * @shared: ring shared by all files in shared mode
+ * @shared_users: number of files in shared mode
+ * @commands: actions written asynchronously and not applied yet
+ * @command_count: number of queued @commands
+ * @command_lock: protects @commands
+ * @command_work: applies the queued @commands
+ * @command_time: time the oldest of the queued @commands was written
+ * @pass_task: task calling the pass() method, whose actions are
+ *	acknowledgements
+ * @ack_time: time the device started to apply the current write
+ * @ack_issued: time the current write was issued
+ * @ack_sequence: number of writes applied
+ * @acks: acknowledgements not passed to the queues yet
+ * @state: latest value of every index of the supported types
+ * @state_pending: values of the current frame, published at its sync
+ * @state_offset: position of the values of every type in @state
+ * @state_time: time of the last sensor frame for every supported clock
+ * @state_sequence: sequence number of the last sensor frame
+ * @state_seq: guards the state, writers are serialized by @action_lock
+ * @stats: counters of the device, see struct senseact_stats
  * @dev: driver model's view of this device
  */
 struct senseact_device {
@@ -126,13 +532,17 @@ struct senseact_device {
 	void *private;
 
 	unsigned long types[BITS_TO_LONGS(SENSEACT_TYPE_CNT)];
+	struct senseact_capability caps[SENSEACT_TYPE_CNT];
 
 	int (*open)(struct senseact_device *senseact);
 	void (*close)(struct senseact_device *senseact);
 	int (*flush)(struct senseact_device *senseact, struct file *file);
 	int (*pass)(struct senseact_device *senseact, unsigned int type, unsigned int index, unsigned int count, int *values);
+	void (*set_interval)(struct senseact_device *senseact, unsigned int interval);
+	unsigned int min_interval;
 
 	struct mutex mutex;
+	struct mutex pass_mutex;
 
 	unsigned int minor;
 	unsigned int users;
@@ -143,6 +553,34 @@ struct senseact_device {
 	struct list_head queue_list;
 	spinlock_t queue_lock;
 
+	ktime_t frame_time[SENSEACT_CLK_MAX];
+	u32 sequence;
+	int frame_open;
+
+	struct senseact_shared *shared;
+	atomic_t shared_users;
+
+	struct senseact_action commands[SENSEACT_COMMAND_MAX];
+	unsigned int command_count;
+	spinlock_t command_lock;
+	struct work_struct command_work;
+	ktime_t command_time;
+
+	struct task_struct *pass_task;
+	ktime_t ack_time[SENSEACT_CLK_MAX];
+	ktime_t ack_issued;
+	u32 ack_sequence;
+	struct senseact_acks *acks;
+
+	int *state;
+	int *state_pending;
+	unsigned int state_offset[SENSEACT_TYPE_CNT];
+	ktime_t state_time[SENSEACT_CLK_MAX];
+	u32 state_sequence;
+	seqcount_t state_seq;
+
+	atomic64_t stats[SENSEACT_STAT_MAX];
+
 	wait_queue_head_t wait;	
 
 	struct device dev;
@@ -154,6 +592,7 @@ struct senseact_device *senseact_allocate_device(void);
 void senseact_free_device(struct senseact_device *senseact);
 
 void senseact_set_capabilities(struct senseact_device *senseact, unsigned int type, unsigned int count);
+void senseact_set_unit(struct senseact_device *senseact, unsigned int type, int prefix, unsigned int unit);
 
 static inline void senseact_set_capability(struct senseact_device *senseact, unsigned int type)
 {
@@ -180,6 +619,10 @@ static inline void senseact_pass_action(struct senseact_device *senseact,  unsig
 	senseact_pass_actions(senseact, type, prefix, index, 1, &value);
 }
 
+void senseact_begin_frame(struct senseact_device *senseact);
+void senseact_begin_frame_at(struct senseact_device *senseact, ktime_t time, u32 sequence);
+void senseact_abort_frame(struct senseact_device *senseact);
+
 static inline void senseact_sync(struct senseact_device *senseact, unsigned int index)
 {
 	senseact_pass_action(senseact, SENSEACT_TYPE_SYNC, 0, index, 0);
@@ -0,0 +1,449 @@
+/*
+ * Functional test of the senseact core against the senseact-test driver
+ *
+ * Drives the benchmark attribute of the test device to produce frames of
+ * TEST_WIDTH increments and checks what the queues of the device return.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>             /* getopt_long() */
+
+#include <fcntl.h>              /* low-level i/o */
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+#include <linux/senseact.h>
+
+/* number of increments in a benchmark frame of the test driver */
+#define TEST_WIDTH	16
+#define TEST_FRAME	(TEST_WIDTH + 1)
+
+#define TEST_QUEUE	64
+#define TEST_MAX	1024
+
+static char *device;
+static char *bench;
+static int verbose;
+
+static void usage(int argc, char **argv)
+{
+	printf("Usage: %s [options]\n\n"
+	       "Version 0.1\n"
+	       "Options:\n"
+	       "-d | --device name   Senseact device of the test driver [%s]\n"
+	       "-b | --bench path    Benchmark attribute of the test driver [%s]\n"
+	       "-v | --verbose       Print the actions read\n"
+	       "-h | --help          Print this message\n"
+	       "",
+	       argv[0], device, bench);
+}
+
+static const char short_options[] = "d:b:vh";
+
+static const struct option long_options[] = {
+	{ "device",  required_argument, NULL, 'd' },
+	{ "bench",   required_argument, NULL, 'b' },
+	{ "verbose", no_argument,       NULL, 'v' },
+	{ "help",    no_argument,       NULL, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static int fail(const char *test, const char *msg)
+{
+	printf("%s: FAIL (%s)\n", test, msg);
+	return -1;
+}
+
+/*
+ * Open a queue of the test device which receives the benchmark frames
+ * only, as extended actions.
+ */
+static int open_queue(__u32 size, __u32 flags)
+{
+	struct senseact_filter filter;
+	__u32 format = SENSEACT_FORMAT_EXT;
+	int fd;
+
+	fd = open(device, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.types = SENSEACT_TYPE_BIT(SENSEACT_TYPE_SYNC) |
+		       SENSEACT_TYPE_BIT(SENSEACT_TYPE_INCREMENT);
+	filter.index_max = 0xff;
+	filter.flags = SENSEACT_FILTER_NO_ACK;
+
+	if (ioctl(fd, SENSEACT_IOCSQUEUESIZE, &size) < 0 ||
+	    ioctl(fd, SENSEACT_IOCSFORMAT, &format) < 0 ||
+	    ioctl(fd, SENSEACT_IOCSFILTER, &filter) < 0 ||
+	    (flags && ioctl(fd, SENSEACT_IOCSFLAGS, &flags) < 0)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Let the test driver pass @frames benchmark frames.
+ */
+static int run_bench(unsigned int frames)
+{
+	char buf[16];
+	int fd, n, retval = 0;
+
+	fd = open(bench, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	n = snprintf(buf, sizeof(buf), "%u\n", frames);
+	if (write(fd, buf, n) != n)
+		retval = -1;
+
+	close(fd);
+	return retval;
+}
+
+/*
+ * Read the actions available on @fd, at most @count. Returns the number
+ * of actions read or -1.
+ */
+static int read_actions(int fd, struct senseact_action_ext *actions,
+			unsigned int count)
+{
+	unsigned int n = 0;
+	ssize_t len;
+
+	while (n < count) {
+		len = read(fd, actions + n, (count - n) * sizeof(*actions));
+		if (len < 0)
+			return errno == EAGAIN ? (int)n : -1;
+		if (len == 0)
+			break;
+
+		n += len / sizeof(*actions);
+	}
+
+	return n;
+}
+
+/*
+ * Check that @actions consist of complete benchmark frames with the
+ * values of consecutive runs. Frames of the sensor poll of the driver
+ * are filtered down to their sync and skipped. Returns the number of
+ * benchmark frames or -1, @value holds the value of the last frame.
+ */
+static int check_frames(struct senseact_action_ext *actions, unsigned int n,
+			int consecutive, int *value)
+{
+	unsigned int i = 0, j, frames = 0;
+
+	while (i < n) {
+		if (actions[i].type == SENSEACT_TYPE_SYNC) {
+			i++;
+			continue;
+		}
+
+		if (n - i < TEST_FRAME)
+			return -1;
+
+		for (j = 0; j < TEST_WIDTH; j++) {
+			if (verbose)
+				printf("increment%u = %i\n", actions[i + j].index,
+				       actions[i + j].value);
+
+			if (actions[i + j].type != SENSEACT_TYPE_INCREMENT ||
+			    actions[i + j].index != j ||
+			    actions[i + j].value != actions[i].value ||
+			    actions[i + j].sequence != actions[i].sequence)
+				return -1;
+		}
+
+		if (actions[i + j].type != SENSEACT_TYPE_SYNC ||
+		    actions[i + j].sequence != actions[i].sequence)
+			return -1;
+
+		if (consecutive && frames && actions[i].value != *value + 1)
+			return -1;
+
+		*value = actions[i].value;
+		frames++;
+		i += TEST_FRAME;
+	}
+
+	return frames;
+}
+
+/*
+ * Produce more actions than the queue holds in small steps, reading in
+ * between, so that head and tail wrap around the ring.
+ */
+static int test_wrap(void)
+{
+	struct senseact_action_ext actions[TEST_MAX];
+	__u32 overruns;
+	int fd, n, i, value, last = 0, frames = 0;
+
+	fd = open_queue(TEST_QUEUE, 0);
+	if (fd < 0)
+		return fail("wrap", "open");
+
+	for (i = 0; i < 4 * TEST_QUEUE / TEST_FRAME; i++) {
+		if (run_bench(2))
+			return fail("wrap", "bench");
+
+		n = read_actions(fd, actions, TEST_MAX);
+		if (n < 0)
+			return fail("wrap", "read");
+
+		n = check_frames(actions, n, 1, &value);
+		if (n != 2)
+			return fail("wrap", "frames");
+
+		if (frames && value != last + 2)
+			return fail("wrap", "lost frame");
+
+		last = value;
+		frames += n;
+	}
+
+	if (ioctl(fd, SENSEACT_IOCGOVERRUNS, &overruns) < 0 || overruns)
+		return fail("wrap", "overruns");
+
+	close(fd);
+	printf("wrap: ok (%i frames)\n", frames);
+	return 0;
+}
+
+/*
+ * Produce more actions than the queue holds without reading. The queue
+ * has to count the dropped actions and keep its frames intact.
+ */
+static int test_overrun(void)
+{
+	struct senseact_action_ext actions[TEST_MAX];
+	__u32 overruns;
+	int fd, n, value;
+
+	fd = open_queue(TEST_QUEUE, 0);
+	if (fd < 0)
+		return fail("overrun", "open");
+
+	if (run_bench(2 * TEST_QUEUE / TEST_FRAME))
+		return fail("overrun", "bench");
+
+	if (ioctl(fd, SENSEACT_IOCGOVERRUNS, &overruns) < 0 || !overruns)
+		return fail("overrun", "no overruns");
+
+	n = read_actions(fd, actions, TEST_MAX);
+	if (n <= 0)
+		return fail("overrun", "read");
+
+	if (check_frames(actions, n, 1, &value) <= 0)
+		return fail("overrun", "frames");
+
+	close(fd);
+	printf("overrun: ok (%u dropped)\n", overruns);
+	return 0;
+}
+
+/*
+ * Every reader of the device receives every frame.
+ */
+static int test_readers(void)
+{
+	struct senseact_action_ext actions[TEST_MAX];
+	int fd[2], n, i, value[2];
+
+	for (i = 0; i < 2; i++) {
+		fd[i] = open_queue(TEST_QUEUE, 0);
+		if (fd[i] < 0)
+			return fail("readers", "open");
+	}
+
+	if (run_bench(3))
+		return fail("readers", "bench");
+
+	for (i = 0; i < 2; i++) {
+		n = read_actions(fd[i], actions, TEST_MAX);
+		if (n < 0)
+			return fail("readers", "read");
+
+		if (check_frames(actions, n, 1, &value[i]) != 3)
+			return fail("readers", "frames");
+	}
+
+	if (value[0] != value[1])
+		return fail("readers", "values differ");
+
+	for (i = 0; i < 2; i++)
+		close(fd[i]);
+
+	printf("readers: ok\n");
+	return 0;
+}
+
+/*
+ * In frame mode every read returns complete frames only and fails if
+ * the buffer cannot hold the next frame.
+ */
+static int test_frames(void)
+{
+	struct senseact_action_ext actions[TEST_MAX];
+	ssize_t len;
+	int fd, n, value, frames = 0;
+
+	fd = open_queue(TEST_QUEUE, SENSEACT_FLAG_FRAME);
+	if (fd < 0)
+		return fail("frames", "open");
+
+	if (run_bench(3))
+		return fail("frames", "bench");
+
+	/* only the syncs left of the sensor poll fit into a short buffer */
+	do {
+		len = read(fd, actions, (TEST_FRAME - 1) * sizeof(*actions));
+	} while (len > 0 &&
+		 !check_frames(actions, len / sizeof(*actions), 0, &value));
+
+	if (len >= 0 || errno != EINVAL)
+		return fail("frames", "short buffer");
+
+	for (;;) {
+		len = read(fd, actions, (TEST_FRAME + TEST_FRAME / 2) * sizeof(*actions));
+		if (len < 0)
+			break;
+
+		n = len / sizeof(*actions);
+		if (actions[n - 1].type != SENSEACT_TYPE_SYNC)
+			return fail("frames", "torn frame");
+
+		n = check_frames(actions, n, 1, &value);
+		if (n < 0 || n > 1)
+			return fail("frames", "frames");
+
+		frames += n;
+	}
+
+	if (errno != EAGAIN || frames != 3)
+		return fail("frames", "read");
+
+	close(fd);
+	printf("frames: ok\n");
+	return 0;
+}
+
+/*
+ * Written positions are passed to the driver, which reports them back as
+ * acknowledgements terminated by an actor sync.
+ */
+static int test_roundtrip(void)
+{
+	struct senseact_action written[2], actions[8];
+	struct senseact_filter filter;
+	struct pollfd pfd;
+	int fd, n;
+
+	fd = open(device, O_RDWR | O_NONBLOCK);
+	if (fd < 0)
+		return fail("roundtrip", "open");
+
+	memset(&filter, 0, sizeof(filter));
+	filter.types = ~0;
+	filter.index_max = 0xff;
+	filter.flags = SENSEACT_FILTER_ACK_ONLY;
+
+	if (ioctl(fd, SENSEACT_IOCSFILTER, &filter) < 0)
+		return fail("roundtrip", "filter");
+
+	memset(written, 0, sizeof(written));
+	written[0].type = SENSEACT_TYPE_POSITION;
+	written[0].index = 0;
+	written[0].value = 42;
+	written[1].type = SENSEACT_TYPE_POSITION;
+	written[1].index = 1;
+	written[1].value = -7;
+
+	if (write(fd, written, sizeof(written)) != sizeof(written))
+		return fail("roundtrip", "write");
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) <= 0)
+		return fail("roundtrip", "no acknowledgement");
+
+	n = read(fd, actions, sizeof(actions));
+	if (n != 3 * sizeof(struct senseact_action))
+		return fail("roundtrip", "read");
+
+	if (actions[0].type != SENSEACT_TYPE_POSITION ||
+	    actions[0].index != 0 || actions[0].value != 42 ||
+	    actions[1].type != SENSEACT_TYPE_POSITION ||
+	    actions[1].index != 1 || actions[1].value != -7 ||
+	    actions[2].type != SENSEACT_TYPE_SYNC)
+		return fail("roundtrip", "values");
+
+	close(fd);
+	printf("roundtrip: ok\n");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+
+	device = "/dev/senseact0";
+	bench = "/sys/devices/platform/senseact-test/benchmark";
+
+	for (;;) {
+		int idx;
+		int c;
+
+		c = getopt_long(argc, argv,
+				short_options, long_options, &idx);
+
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			device = optarg;
+			break;
+
+		case 'b':
+			bench = optarg;
+			break;
+
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 'h':
+			usage(argc, argv);
+			exit(EXIT_SUCCESS);
+
+		default:
+			usage(argc, argv);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	failed |= test_wrap();
+	failed |= test_overrun();
+	failed |= test_readers();
+	failed |= test_frames();
+	failed |= test_roundtrip();
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -13,6 +13,7 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 
 #include <linux/senseact.h>
 
@@ -26,6 +27,11 @@ static void usage(int argc, char **argv)
 	       "-d | --device name   Senseact device name [%s]\n"
 	       "-h | --help          Print this message\n"
 	       "-r | --read          Read from the device [default]\n"
+	       "-m | --mmap          Read from the mapped ring of the device\n"
+	       "-c | --capabilities  List the capabilities of the device\n"
+	       "-g | --state         Print the latest values of the device\n"
+	       "-s | --shared        Read from the ring shared with other readers\n"
+	       "-p | --interval ms   Request a sample interval\n"
 	       "-w | --write         Write to the device\n"
 	       "-t | --type          Set action type\n"
 	       "-i | --index         Set action index\n"
@@ -34,54 +40,130 @@ static void usage(int argc, char **argv)
 	       argv[0], device);
 }
 
+static char *type[SENSEACT_TYPE_CNT] = {
+	"sync",
+	"brightness",
+	"enable",
+	"speed",
+	"position",
+	"angle",
+	"increment",
+	"unknown",
+};
+
+static char *prefix[16] = {
+	"",
+	"k",
+	"M",
+	"G",
+	"T",
+	"P",
+	"E",
+	"Z",
+	"y",
+	"z",
+	"a",
+	"f",
+	"p",
+	"n",
+	"u",
+	"m",
+};
+
+static char *unit[SENSEACT_UNIT_MAX + 1] = {
+	"",
+	"m",
+	"rad",
+	"m/s",
+	"rad/s",
+	"s",
+	"V",
+};
+
 static void print(struct senseact_action *action)
 {
-	char *type[SENSEACT_TYPE_CNT] = {
-		"sync",
-		"brightness",
-		"enable",
-		"speed",
-		"position",
-		"angle",
-		"increment",
-		"unknown",
-	};
-
-	char *prefix[16] = {
-		"",
-		"k",
-		"M",
-		"G",
-		"T",
-		"P",
-		"E",
-		"Z",
-		"y",
-		"z",
-		"a",
-		"f",
-		"p",
-		"n",
-		"u",
-		"m",
-	};
-
 	if (action->type > SENSEACT_TYPE_MAX)
 		return;
 
-	printf("%s%i = %i %s\n",
+	printf("%s%i = %i %s%s\n",
 	       type[action->type],
 	       action->index,
 	       action->value,
-	       prefix[action->prefix & 0xf]);
+	       prefix[action->prefix & 0xf],
+	       action->unit > SENSEACT_UNIT_MAX ? "" : unit[action->unit]);
 }
 
-static const char short_options[] = "d:hrwt:i:v:";
+static int print_capabilities(int fd)
+{
+	struct senseact_capability cap;
+	unsigned int i;
+
+	for (i = 0; i <= SENSEACT_TYPE_MAX; i++) {
+		memset(&cap, 0, sizeof(cap));
+		cap.type = i;
+
+		if (ioctl(fd, SENSEACT_IOCGCAPABILITY, &cap) < 0)
+			return -1;
+
+		if (cap.count == 0)
+			continue;
+
+		printf("%s: %u [%s%s]\n",
+		       type[cap.type],
+		       cap.count,
+		       prefix[cap.prefix & 0xf],
+		       cap.unit > SENSEACT_UNIT_MAX ? "" : unit[cap.unit]);
+	}
+
+	return 0;
+}
+
+static int print_state(int fd)
+{
+	struct senseact_state state;
+	struct senseact_capability cap;
+	__s32 values[SENSEACT_TYPE_CNT * 256];
+	unsigned int i, j, n = 0;
+
+	memset(&state, 0, sizeof(state));
+	state.types = ~0;
+	state.count = SENSEACT_TYPE_CNT * 256;
+	state.values = (unsigned long)values;
+
+	if (ioctl(fd, SENSEACT_IOCGSTATE, &state) < 0)
+		return -1;
+
+	printf("sequence %u at %llu ns\n", state.sequence,
+	       (unsigned long long)state.time);
+
+	for (i = SENSEACT_TYPE_SYNC + 1; i <= SENSEACT_TYPE_MAX; i++) {
+		memset(&cap, 0, sizeof(cap));
+		cap.type = i;
+
+		if (ioctl(fd, SENSEACT_IOCGCAPABILITY, &cap) < 0)
+			return -1;
+
+		for (j = 0; j < cap.count && n < state.count; j++, n++)
+			printf("%s%u = %i %s%s\n",
+			       type[i], j, values[n],
+			       prefix[cap.prefix & 0xf],
+			       cap.unit > SENSEACT_UNIT_MAX ? "" : unit[cap.unit]);
+	}
+
+	return 0;
+}
+
+static const char short_options[] = "d:hrmcgsp:wt:i:v:";
 
 static const struct option long_options[] = {
 	{ "device", required_argument, NULL, 'd' },
 	{ "help",   no_argument,       NULL, 'h' },
 	{ "read",   no_argument,       NULL, 'r' },
+	{ "mmap",   no_argument,       NULL, 'm' },
+	{ "capabilities", no_argument, NULL, 'c' },
+	{ "state",  no_argument,       NULL, 'g' },
+	{ "shared", no_argument,       NULL, 's' },
+	{ "interval", required_argument, NULL, 'p' },
 	{ "write",  no_argument,       NULL, 'w' },
 	{ "type",   required_argument, NULL, 't' },
 	{ "index",  required_argument, NULL, 'i' },
@@ -89,10 +171,42 @@ static const struct option long_options[] = {
 	{ 0, 0, 0, 0 }
 };
 
+static int read_ring(int fd)
+{
+	struct senseact_ring *ring;
+	struct pollfd pfd;
+	__u32 size;
+	int i, n;
+
+	if (ioctl(fd, SENSEACT_IOCGMMAPSIZE, &size) < 0)
+		return -1;
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		return -1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, -1) > 0 && !(pfd.revents & POLLHUP)) {
+		n = senseact_ring_count(ring);
+
+		for (i = 0; i < n; i++)
+			print(senseact_ring_peek(ring, i));
+
+		senseact_ring_consume(ring, n);
+	}
+
+	munmap(ring, size);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int fd, i, n;
 	int dir = 1;
+	__u32 flags = 0;
+	__u32 interval = 0;
 	struct senseact_action actions[20];
 
 	device = "/dev/senseact0";
@@ -123,6 +237,26 @@ int main(int argc, char **argv)
 			dir = 1;
 			break;
 
+		case 'm':
+			dir = 2;
+			break;
+
+		case 'c':
+			dir = 3;
+			break;
+
+		case 'g':
+			dir = 4;
+			break;
+
+		case 's':
+			flags |= SENSEACT_FLAG_SHARED;
+			break;
+
+		case 'p':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+
 		case 'w':
 			dir = 0;
 			break;
@@ -149,9 +283,24 @@ int main(int argc, char **argv)
 	if (fd <= 0)
 		exit(EXIT_FAILURE);
 
+	if (flags && ioctl(fd, SENSEACT_IOCSFLAGS, &flags) < 0)
+		perror("ioctl");
+
+	if (interval && ioctl(fd, SENSEACT_IOCSINTERVAL, &interval) < 0)
+		perror("ioctl");
+
 	if (dir == 0) {
 		print(&actions[0]);
 		n = write(fd, &actions, sizeof(struct senseact_action));
+	} else if (dir == 4) {
+		if (print_state(fd))
+			perror("ioctl");
+	} else if (dir == 3) {
+		if (print_capabilities(fd))
+			perror("ioctl");
+	} else if (dir == 2) {
+		if (read_ring(fd))
+			perror("mmap");
 	} else {
 		do {
 			n = read(fd, &actions, 20 * sizeof(struct senseact_action));